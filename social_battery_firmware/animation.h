@@ -0,0 +1,220 @@
+/*
+ * Single-File-Header for playing keyframe animations
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 Renze Nicolai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// An animation is a list of keyframes, each holding a color for every LED. The
+// colors fade from one keyframe to the next over the duration of the first one,
+// following its easing curve. The animation is read from memory while it plays,
+// so it can live in a buffer the host writes to.
+//
+// Format, all colors are R, G, B:
+//
+//   byte 0: ANIMATION_MAGIC
+//   byte 1: number of keyframes
+//   byte 2: flags, see ANIMATION_FLAG_*
+//   byte 3: trigger sources, bit n is input event source n
+//   keyframes of ANIMATION_KEYFRAME_SIZE bytes:
+//     byte 0: duration in 10 ms units, or 100 ms units with ANIMATION_EASE_SLOW
+//     byte 1: easing towards the next keyframe, see ANIMATION_EASE_*
+//     byte 2: colors of the LEDs, 3 bytes each
+//
+// Without ANIMATION_FLAG_LOOP the animation stops at its last keyframe. With
+// ANIMATION_FLAG_TRIGGERED it shows the first keyframe until it is triggered by
+// an input event from one of the trigger sources. Every trigger restarts it.
+
+#ifndef __ANIMATION_H
+#define __ANIMATION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "color_utilities.h"
+
+#ifndef ANIMATION_LEDS
+#define ANIMATION_LEDS 5
+#endif
+
+#define ANIMATION_MAGIC         0x4B // 'K'
+#define ANIMATION_HEADER_SIZE   4
+#define ANIMATION_KEYFRAME_SIZE (2 + ANIMATION_LEDS * 3)
+
+// Flags
+#define ANIMATION_FLAG_LOOP      0x01 // Continue with the first keyframe after the last one
+#define ANIMATION_FLAG_TRIGGERED 0x02 // Wait for a trigger before playing
+
+// Easing, lower nibble of the easing byte
+#define ANIMATION_EASE_STEP     0 // Hold the colors, then jump to the next keyframe
+#define ANIMATION_EASE_LINEAR   1
+#define ANIMATION_EASE_IN       2 // Quadratic, starts slow
+#define ANIMATION_EASE_OUT      3 // Quadratic, ends slow
+#define ANIMATION_EASE_IN_OUT   4
+#define ANIMATION_EASE_MASK     0x0F
+#define ANIMATION_EASE_SLOW     0x10 // Duration in 100 ms units
+
+struct _animation_state {
+    const volatile uint8_t* data;
+    uint16_t size;
+    uint8_t keyframe;
+    uint32_t keyframe_start; // ms
+    bool waiting;            // Waiting for a trigger
+    bool finished;           // Holding the last keyframe
+} animation_state;
+
+void SetupAnimation(const volatile uint8_t* data, uint16_t size) {
+    animation_state.data = data;
+    animation_state.size = size;
+    animation_state.keyframe = 0;
+    animation_state.keyframe_start = 0;
+    animation_state.waiting = false;
+    animation_state.finished = false;
+}
+
+static uint8_t AnimationKeyframes() {
+    return animation_state.data[1];
+}
+
+static const volatile uint8_t* AnimationKeyframe(uint8_t index) {
+    return &animation_state.data[ANIMATION_HEADER_SIZE + index * ANIMATION_KEYFRAME_SIZE];
+}
+
+bool AnimationValid() {
+    if (animation_state.size < ANIMATION_HEADER_SIZE || animation_state.data[0] != ANIMATION_MAGIC) {
+        return false;
+    }
+    uint8_t count = AnimationKeyframes();
+    return count > 0 && ANIMATION_HEADER_SIZE + count * ANIMATION_KEYFRAME_SIZE <= animation_state.size;
+}
+
+// Start from the first keyframe, a triggered animation waits for its trigger again
+void RestartAnimation(uint32_t now) {
+    animation_state.keyframe = 0;
+    animation_state.keyframe_start = now;
+    animation_state.finished = false;
+    animation_state.waiting = AnimationValid() && (animation_state.data[2] & ANIMATION_FLAG_TRIGGERED);
+}
+
+// Play from the first keyframe without waiting for a trigger
+void TriggerAnimation(uint32_t now) {
+    animation_state.keyframe = 0;
+    animation_state.keyframe_start = now;
+    animation_state.finished = false;
+    animation_state.waiting = false;
+}
+
+// Pass an input event, returns true if it triggered the animation
+bool AnimationEvent(uint8_t source, uint32_t now) {
+    if (!AnimationValid() || !(animation_state.data[2] & ANIMATION_FLAG_TRIGGERED) || source >= 8 || !((animation_state.data[3] >> source) & 1)) {
+        return false;
+    }
+    TriggerAnimation(now);
+    return true;
+}
+
+uint8_t GetAnimationKeyframe() {
+    return animation_state.keyframe;
+}
+
+bool AnimationWaiting() {
+    return animation_state.waiting;
+}
+
+bool AnimationFinished() {
+    return animation_state.finished;
+}
+
+static uint32_t AnimationDuration(const volatile uint8_t* keyframe) {
+    return keyframe[0] * ((keyframe[1] & ANIMATION_EASE_SLOW) ? 100 : 10);
+}
+
+// Map the linear progress 0-255 onto the easing curve
+static uint8_t AnimationEase(uint8_t easing, uint8_t t) {
+    uint8_t r = 255 - t;
+    switch (easing & ANIMATION_EASE_MASK) {
+        case ANIMATION_EASE_STEP:
+            return 0;
+        case ANIMATION_EASE_IN:
+            return (t * t) / 255;
+        case ANIMATION_EASE_OUT:
+            return 255 - (r * r) / 255;
+        case ANIMATION_EASE_IN_OUT:
+            return t < 128 ? (2 * t * t) / 255 : 255 - (2 * r * r) / 255;
+        default:
+            return t;
+    }
+}
+
+static uint32_t AnimationColor(const volatile uint8_t* keyframe, uint8_t led) {
+    const volatile uint8_t* color = &keyframe[2 + led * 3];
+    return ((uint32_t) color[0] << 16) | ((uint32_t) color[1] << 8) | color[2];
+}
+
+// Compute the colors at time now in milliseconds, as 0xRRGGBB. Returns false
+// if there is no valid animation.
+bool RenderAnimation(uint32_t now, uint32_t* colors) {
+    if (!AnimationValid()) {
+        return false;
+    }
+
+    uint8_t count = AnimationKeyframes();
+    bool loop = animation_state.data[2] & ANIMATION_FLAG_LOOP;
+    if (animation_state.keyframe >= count) {
+        animation_state.keyframe = 0; // The animation was replaced by a shorter one
+    }
+
+    if (animation_state.waiting || animation_state.finished) {
+        animation_state.keyframe_start = now;
+    }
+
+    // Skip the keyframes that have ended, at most one round so a loop of zero length cannot hang
+    for (uint8_t i = 0; i < count && !animation_state.waiting && !animation_state.finished; i++) {
+        uint32_t duration = AnimationDuration(AnimationKeyframe(animation_state.keyframe));
+        if (now - animation_state.keyframe_start < duration) {
+            break;
+        }
+        if (animation_state.keyframe + 1 >= count && !loop) {
+            animation_state.finished = true;
+            break;
+        }
+        animation_state.keyframe_start += duration;
+        animation_state.keyframe = animation_state.keyframe + 1 < count ? animation_state.keyframe + 1 : 0;
+    }
+
+    const volatile uint8_t* from = AnimationKeyframe(animation_state.keyframe);
+    uint8_t next = animation_state.keyframe + 1 < count ? animation_state.keyframe + 1 : 0;
+    uint8_t tween = 0;
+    if (!animation_state.waiting && !animation_state.finished && (next > 0 || loop)) {
+        uint32_t duration = AnimationDuration(from);
+        uint32_t elapsed = now - animation_state.keyframe_start;
+        if (duration > 0 && elapsed < duration) {
+            tween = AnimationEase(from[1], elapsed * 255 / duration);
+        }
+    }
+    const volatile uint8_t* to = AnimationKeyframe(next);
+    for (uint8_t led = 0; led < ANIMATION_LEDS; led++) {
+        colors[led] = TweenHexColors(AnimationColor(from, led), AnimationColor(to, led), tween);
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,132 @@
+/*
+ * Single-File-Header for an emulated EEPROM backed by flash
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 Renze Nicolai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// The EEPROM contents are read straight from flash. Writes go to a RAM copy of one
+// flash page, WriteEeprom() loads the page it writes to, writing the page it held
+// before back to flash first when that was modified. The modified page is written
+// back by FlushEeprom(), which the application calls once writes have stopped for
+// a while. This keeps the number of flash erase cycles down when a host writes the
+// EEPROM in many small transactions that go through it in order.
+//
+// Until it has been written back the modified page only exists in RAM, readers that
+// need to see it use GetEepromPage().
+//
+// A flash page is erased before it is programmed, a power loss in between loses
+// the contents of that page.
+//
+// The initial contents are part of the firmware image, see EEPROM_INITIAL_DATA.
+
+#ifndef __EEPROM_H
+#define __EEPROM_H
+
+#include "flash.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define EEPROM_SIZE  256
+#define EEPROM_PAGES (EEPROM_SIZE / FLASH_PAGE_SIZE) // Flash pages
+
+#ifndef EEPROM_INITIAL_DATA
+#define EEPROM_INITIAL_DATA {0}
+#endif
+
+const uint8_t eeprom_flash[EEPROM_SIZE] FLASH_STORAGE = EEPROM_INITIAL_DATA;
+
+struct _eeprom_state {
+    volatile uint8_t page[FLASH_PAGE_SIZE]; // Copy of a flash page that is being written
+    uint8_t loaded;   // Flash page in page, EEPROM_PAGES when there is none
+    bool dirty;       // page differs from the flash
+    uint16_t flushes; // Flash pages written since boot
+} eeprom_state;
+
+void SetupEeprom() {
+    eeprom_state.loaded = EEPROM_PAGES;
+    eeprom_state.dirty = false;
+    eeprom_state.flushes = 0;
+}
+
+// The contents as stored in flash
+const volatile uint8_t* GetEepromData() {
+    return eeprom_flash;
+}
+
+// The page being written, it replaces the contents from GetEepromPageOffset() on
+volatile uint8_t* GetEepromPage() {
+    return eeprom_state.page;
+}
+
+// Offset of the page being written, EEPROM_SIZE when there is none
+uint16_t GetEepromPageOffset() {
+    return eeprom_state.loaded * FLASH_PAGE_SIZE;
+}
+
+bool EepromDirty() {
+    return eeprom_state.dirty;
+}
+
+// Write the modified page back to flash
+void FlushEeprom() {
+    if (!eeprom_state.dirty) {
+        return;
+    }
+    uint32_t address = (uint32_t) &eeprom_flash[eeprom_state.loaded * FLASH_PAGE_SIZE];
+    UnlockFlash();
+    EraseFlashPage(address);
+    for (uint16_t i = 0; i < FLASH_PAGE_SIZE; i += 2) {
+        ProgramFlashHalfWord(address + i, eeprom_state.page[i] | (eeprom_state.page[i + 1] << 8));
+    }
+    LockFlash();
+    eeprom_state.dirty = false;
+    eeprom_state.flushes++;
+}
+
+// Write a byte. When it is in another page than the one being written that page is
+// written back to flash first, which stalls the CPU.
+void WriteEeprom(uint16_t offset, uint8_t value) {
+    if (offset >= EEPROM_SIZE) {
+        return;
+    }
+    uint8_t page = offset / FLASH_PAGE_SIZE;
+    if (page != eeprom_state.loaded) {
+        FlushEeprom();
+        const volatile uint8_t* flash = &eeprom_flash[page * FLASH_PAGE_SIZE];
+        for (uint16_t i = 0; i < FLASH_PAGE_SIZE; i++) {
+            eeprom_state.page[i] = flash[i];
+        }
+        eeprom_state.loaded = page;
+    }
+    if (eeprom_state.page[offset % FLASH_PAGE_SIZE] != value) {
+        eeprom_state.page[offset % FLASH_PAGE_SIZE] = value;
+        eeprom_state.dirty = true;
+    }
+}
+
+uint16_t GetEepromFlushes() {
+    return eeprom_state.flushes;
+}
+
+#endif
@@ -0,0 +1,430 @@
+/*
+ * Single-File-Header for running LED effect bytecode
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 Renze Nicolai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// A small stack machine for procedural LED effects. The program runs from the
+// start once per frame until it ends, setting the colors of the LEDs on the
+// way. Values are signed 16-bit, fixed point values use 8 fractional bits.
+// Variables keep their values from one frame to the next, the stack does not.
+//
+// Every frame is limited to EFFECT_VM_BUDGET instructions, a program that runs
+// out of them or does anything invalid is stopped for that frame. The colors
+// it set before that are kept.
+//
+// This file has no dependencies on the hardware, tools/effect_vm.c uses it to
+// assemble and simulate programs on the host.
+//
+// Format:
+//
+//   byte 0: EFFECT_VM_MAGIC
+//   byte 1: length of the code in bytes
+//   code, one byte opcode followed by its operand bytes
+//
+// Opcodes, stack effects are written as (popped -- pushed), topmost last:
+//
+//   end              ( -- )        End the frame
+//   push n           ( -- n)       Signed 8-bit operand
+//   push16 n         ( -- n)       16-bit operand, LSB first
+//   dup              (a -- a a)
+//   drop             (a -- )
+//   swap             (a b -- b a)
+//   over             (a b -- a b a)
+//   load v           ( -- x)       Variable v, 0 to EFFECT_VM_VARS - 1
+//   store v          (x -- )
+//   in i             ( -- x)       Input i, see EFFECT_VM_IN_*
+//   add, sub         (a b -- a+b), (a b -- a-b)
+//   mul              (a b -- a*b)
+//   mulfx            (a b -- a*b/256)
+//   shl, shr         (a b -- a<<b), (a b -- a>>b), shr is arithmetic
+//   and, or, xor     (a b -- a&b), ...
+//   lt, eq           (a b -- a<b), (a b -- a==b), 1 or 0
+//   not              (a -- !a)
+//   neg              (a -- -a)
+//   sin              (a -- x)      sintable[a & 255], 0 to 255
+//   rand             (a -- x)      rands[a & 255], 0 to 255
+//   hsv              (led h s v -- ) Set the color of an LED with EHSVtoHEX()
+//   rgb              (led r g b -- ) Set the color of an LED
+//   each             ( -- )        Run the code up to next once for every LED
+//   led              ( -- led)     LED of the running each loop
+//   next             ( -- )
+//   jmp o            ( -- )        Jump o bytes from the next instruction, signed 8-bit
+//   jz o             (a -- )       Jump if a is zero
+//   touch            (pad -- x)    1 if the touch pad is pressed
+
+#ifndef __EFFECT_VM_H
+#define __EFFECT_VM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "color_utilities.h"
+
+#ifndef EFFECT_VM_LEDS
+#define EFFECT_VM_LEDS 5
+#endif
+
+#ifndef EFFECT_VM_BUDGET
+#define EFFECT_VM_BUDGET 512 // Instructions per frame
+#endif
+
+#define EFFECT_VM_MAGIC       0x56 // 'V'
+#define EFFECT_VM_HEADER_SIZE 2
+#define EFFECT_VM_STACK       8
+#define EFFECT_VM_VARS        8
+
+// Inputs
+#define EFFECT_VM_IN_FRAME    0 // Frames since the start, counted by the VM
+#define EFFECT_VM_IN_TIME     1 // Milliseconds since the start
+#define EFFECT_VM_IN_TOUCH    2 // Bitmask of pressed touch pads
+#define EFFECT_VM_IN_SLIDER   3 // Slider position, 0 to 255
+#define EFFECT_VM_IN_CONTACT  4 // 1 while the slider is touched
+#define EFFECT_VM_IN_SOCIAL   5 // Social level, 0 to 4
+#define EFFECT_VM_INPUTS      6
+
+// Errors
+#define EFFECT_VM_OK          0
+#define EFFECT_VM_ERROR_BUDGET 1 // Ran out of instructions
+#define EFFECT_VM_ERROR_STACK  2 // Stack overflow or underflow
+#define EFFECT_VM_ERROR_CODE   3 // Invalid opcode or operand, or a jump outside of the code
+#define EFFECT_VM_ERROR_LOOP   4 // Nested each, or led or next outside of a loop
+#define EFFECT_VM_ERROR_EMPTY  5 // No valid program
+
+// Opcodes
+enum {
+    EFFECT_VM_OP_END,
+    EFFECT_VM_OP_PUSH,
+    EFFECT_VM_OP_PUSH16,
+    EFFECT_VM_OP_DUP,
+    EFFECT_VM_OP_DROP,
+    EFFECT_VM_OP_SWAP,
+    EFFECT_VM_OP_OVER,
+    EFFECT_VM_OP_LOAD,
+    EFFECT_VM_OP_STORE,
+    EFFECT_VM_OP_IN,
+    EFFECT_VM_OP_ADD,
+    EFFECT_VM_OP_SUB,
+    EFFECT_VM_OP_MUL,
+    EFFECT_VM_OP_MULFX,
+    EFFECT_VM_OP_SHL,
+    EFFECT_VM_OP_SHR,
+    EFFECT_VM_OP_AND,
+    EFFECT_VM_OP_OR,
+    EFFECT_VM_OP_XOR,
+    EFFECT_VM_OP_LT,
+    EFFECT_VM_OP_EQ,
+    EFFECT_VM_OP_NOT,
+    EFFECT_VM_OP_NEG,
+    EFFECT_VM_OP_SIN,
+    EFFECT_VM_OP_RAND,
+    EFFECT_VM_OP_HSV,
+    EFFECT_VM_OP_RGB,
+    EFFECT_VM_OP_EACH,
+    EFFECT_VM_OP_LED,
+    EFFECT_VM_OP_NEXT,
+    EFFECT_VM_OP_JMP,
+    EFFECT_VM_OP_JZ,
+    EFFECT_VM_OP_TOUCH,
+    EFFECT_VM_NUM_OPS,
+};
+
+// Operand bytes, values popped and values pushed of every opcode
+#define EFFECT_VM_OP(operand, pops, pushes) (((operand) << 5) | ((pops) << 2) | (pushes))
+#define EFFECT_VM_OPERAND(op)               (effect_vm_ops[op] >> 5)
+#define EFFECT_VM_POPS(op)                  ((effect_vm_ops[op] >> 2) & 7)
+#define EFFECT_VM_PUSHES(op)                (effect_vm_ops[op] & 3)
+
+static const uint8_t effect_vm_ops[EFFECT_VM_NUM_OPS] = {
+    [EFFECT_VM_OP_END]    = EFFECT_VM_OP(0, 0, 0),
+    [EFFECT_VM_OP_PUSH]   = EFFECT_VM_OP(1, 0, 1),
+    [EFFECT_VM_OP_PUSH16] = EFFECT_VM_OP(2, 0, 1),
+    [EFFECT_VM_OP_DUP]    = EFFECT_VM_OP(0, 1, 2),
+    [EFFECT_VM_OP_DROP]   = EFFECT_VM_OP(0, 1, 0),
+    [EFFECT_VM_OP_SWAP]   = EFFECT_VM_OP(0, 2, 2),
+    [EFFECT_VM_OP_OVER]   = EFFECT_VM_OP(0, 2, 3),
+    [EFFECT_VM_OP_LOAD]   = EFFECT_VM_OP(1, 0, 1),
+    [EFFECT_VM_OP_STORE]  = EFFECT_VM_OP(1, 1, 0),
+    [EFFECT_VM_OP_IN]     = EFFECT_VM_OP(1, 0, 1),
+    [EFFECT_VM_OP_ADD]    = EFFECT_VM_OP(0, 2, 1),
+    [EFFECT_VM_OP_SUB]    = EFFECT_VM_OP(0, 2, 1),
+    [EFFECT_VM_OP_MUL]    = EFFECT_VM_OP(0, 2, 1),
+    [EFFECT_VM_OP_MULFX]  = EFFECT_VM_OP(0, 2, 1),
+    [EFFECT_VM_OP_SHL]    = EFFECT_VM_OP(0, 2, 1),
+    [EFFECT_VM_OP_SHR]    = EFFECT_VM_OP(0, 2, 1),
+    [EFFECT_VM_OP_AND]    = EFFECT_VM_OP(0, 2, 1),
+    [EFFECT_VM_OP_OR]     = EFFECT_VM_OP(0, 2, 1),
+    [EFFECT_VM_OP_XOR]    = EFFECT_VM_OP(0, 2, 1),
+    [EFFECT_VM_OP_LT]     = EFFECT_VM_OP(0, 2, 1),
+    [EFFECT_VM_OP_EQ]     = EFFECT_VM_OP(0, 2, 1),
+    [EFFECT_VM_OP_NOT]    = EFFECT_VM_OP(0, 1, 1),
+    [EFFECT_VM_OP_NEG]    = EFFECT_VM_OP(0, 1, 1),
+    [EFFECT_VM_OP_SIN]    = EFFECT_VM_OP(0, 1, 1),
+    [EFFECT_VM_OP_RAND]   = EFFECT_VM_OP(0, 1, 1),
+    [EFFECT_VM_OP_HSV]    = EFFECT_VM_OP(0, 4, 0),
+    [EFFECT_VM_OP_RGB]    = EFFECT_VM_OP(0, 4, 0),
+    [EFFECT_VM_OP_EACH]   = EFFECT_VM_OP(0, 0, 0),
+    [EFFECT_VM_OP_LED]    = EFFECT_VM_OP(0, 0, 1),
+    [EFFECT_VM_OP_NEXT]   = EFFECT_VM_OP(0, 0, 0),
+    [EFFECT_VM_OP_JMP]    = EFFECT_VM_OP(1, 0, 0),
+    [EFFECT_VM_OP_JZ]     = EFFECT_VM_OP(1, 1, 0),
+    [EFFECT_VM_OP_TOUCH]  = EFFECT_VM_OP(0, 1, 1),
+};
+
+#ifdef EFFECT_VM_NAMES
+// Mnemonics, only needed by the host tools
+static const char* const effect_vm_names[EFFECT_VM_NUM_OPS] = {
+    "end", "push", "push16", "dup", "drop", "swap", "over", "load", "store", "in",
+    "add", "sub", "mul", "mulfx", "shl", "shr", "and", "or", "xor", "lt", "eq",
+    "not", "neg", "sin", "rand", "hsv", "rgb", "each", "led", "next", "jmp", "jz",
+    "touch",
+};
+
+static const char* const effect_vm_inputs[EFFECT_VM_INPUTS] = {
+    "frame", "time", "touch", "slider", "contact", "social",
+};
+#endif
+
+struct _effect_vm_state {
+    const volatile uint8_t* data;
+    uint16_t size;
+    int16_t stack[EFFECT_VM_STACK];
+    int16_t vars[EFFECT_VM_VARS];
+    int16_t input[EFFECT_VM_INPUTS];
+    uint16_t steps; // Instructions executed in the last frame
+    uint8_t error;  // EFFECT_VM_ERROR_* of the last frame
+} effect_vm_state;
+
+void SetupEffectVm(const volatile uint8_t* data, uint16_t size) {
+    effect_vm_state.data = data;
+    effect_vm_state.size = size;
+    effect_vm_state.steps = 0;
+    effect_vm_state.error = EFFECT_VM_OK;
+    for (uint8_t i = 0; i < EFFECT_VM_INPUTS; i++) {
+        effect_vm_state.input[i] = 0;
+    }
+    for (uint8_t i = 0; i < EFFECT_VM_VARS; i++) {
+        effect_vm_state.vars[i] = 0;
+    }
+}
+
+bool EffectVmValid() {
+    return effect_vm_state.size >= EFFECT_VM_HEADER_SIZE && effect_vm_state.data[0] == EFFECT_VM_MAGIC &&
+           EFFECT_VM_HEADER_SIZE + effect_vm_state.data[1] <= effect_vm_state.size;
+}
+
+// Clear the variables and the frame counter, for when the program changes
+void RestartEffectVm() {
+    for (uint8_t i = 0; i < EFFECT_VM_VARS; i++) {
+        effect_vm_state.vars[i] = 0;
+    }
+    effect_vm_state.input[EFFECT_VM_IN_FRAME] = 0;
+}
+
+void SetEffectVmInput(uint8_t input, int16_t value) {
+    if (input < EFFECT_VM_INPUTS) {
+        effect_vm_state.input[input] = value;
+    }
+}
+
+uint16_t GetEffectVmSteps() {
+    return effect_vm_state.steps;
+}
+
+uint8_t GetEffectVmError() {
+    return effect_vm_state.error;
+}
+
+static void EffectVmSetColor(uint32_t* colors, int16_t led, uint32_t color) {
+    if (led >= 0 && led < EFFECT_VM_LEDS) {
+        colors[led] = color;
+    }
+}
+
+// Run the program for one frame, setting colors as 0xRRGGBB. Returns EFFECT_VM_OK
+// or the error that stopped it.
+uint8_t RunEffectVm(uint32_t* colors) {
+    uint8_t error = EFFECT_VM_OK;
+    uint16_t steps = 0;
+
+    if (!EffectVmValid()) {
+        error = EFFECT_VM_ERROR_EMPTY;
+    } else {
+        const volatile uint8_t* code = &effect_vm_state.data[EFFECT_VM_HEADER_SIZE];
+        uint16_t length = effect_vm_state.data[1];
+        int16_t* stack = effect_vm_state.stack;
+        uint8_t sp = 0;          // Number of values on the stack
+        uint16_t pc = 0;
+        uint16_t loop_start = 0; // First instruction of the each loop
+        uint8_t loop_led = 0;
+        bool loop = false;
+
+        while (pc < length) {
+            if (steps >= EFFECT_VM_BUDGET) {
+                error = EFFECT_VM_ERROR_BUDGET;
+                break;
+            }
+            steps++;
+
+            uint8_t op = code[pc++];
+            if (op >= EFFECT_VM_NUM_OPS || pc + EFFECT_VM_OPERAND(op) > length) {
+                error = EFFECT_VM_ERROR_CODE;
+                break;
+            }
+            uint8_t pops = EFFECT_VM_POPS(op);
+            if (sp < pops || sp - pops + EFFECT_VM_PUSHES(op) > EFFECT_VM_STACK) {
+                error = EFFECT_VM_ERROR_STACK;
+                break;
+            }
+            int16_t operand = 0;
+            if (EFFECT_VM_OPERAND(op) == 1) {
+                operand = (int8_t) code[pc];
+            } else if (EFFECT_VM_OPERAND(op) == 2) {
+                operand = code[pc] | (code[pc + 1] << 8);
+            }
+            pc += EFFECT_VM_OPERAND(op);
+
+            // The stack has been checked, a and b are the topmost two values
+            int16_t a = sp >= 2 ? stack[sp - 2] : 0;
+            int16_t b = sp >= 1 ? stack[sp - 1] : 0;
+            int32_t result = 0;
+            sp -= pops;
+
+            switch (op) {
+                case EFFECT_VM_OP_END:
+                    pc = length;
+                    continue;
+                case EFFECT_VM_OP_PUSH:
+                case EFFECT_VM_OP_PUSH16:
+                    result = operand;
+                    break;
+                case EFFECT_VM_OP_DUP:
+                    stack[sp++] = b;
+                    result = b;
+                    break;
+                case EFFECT_VM_OP_DROP:
+                    continue;
+                case EFFECT_VM_OP_SWAP:
+                    stack[sp++] = b;
+                    result = a;
+                    break;
+                case EFFECT_VM_OP_OVER:
+                    stack[sp++] = a;
+                    stack[sp++] = b;
+                    result = a;
+                    break;
+                case EFFECT_VM_OP_LOAD:
+                case EFFECT_VM_OP_STORE:
+                    if (operand < 0 || operand >= EFFECT_VM_VARS) {
+                        error = EFFECT_VM_ERROR_CODE;
+                        break;
+                    }
+                    if (op == EFFECT_VM_OP_STORE) {
+                        effect_vm_state.vars[operand] = b;
+                        continue;
+                    }
+                    result = effect_vm_state.vars[operand];
+                    break;
+                case EFFECT_VM_OP_IN:
+                    if (operand < 0 || operand >= EFFECT_VM_INPUTS) {
+                        error = EFFECT_VM_ERROR_CODE;
+                        break;
+                    }
+                    result = effect_vm_state.input[operand];
+                    break;
+                case EFFECT_VM_OP_ADD:   result = a + b; break;
+                case EFFECT_VM_OP_SUB:   result = a - b; break;
+                case EFFECT_VM_OP_MUL:   result = (int32_t) a * b; break;
+                case EFFECT_VM_OP_MULFX: result = ((int32_t) a * b) >> 8; break;
+                case EFFECT_VM_OP_SHL:   result = (uint16_t) a << (b & 15); break;
+                case EFFECT_VM_OP_SHR:   result = a >> (b & 15); break;
+                case EFFECT_VM_OP_AND:   result = a & b; break;
+                case EFFECT_VM_OP_OR:    result = a | b; break;
+                case EFFECT_VM_OP_XOR:   result = a ^ b; break;
+                case EFFECT_VM_OP_LT:    result = a < b; break;
+                case EFFECT_VM_OP_EQ:    result = a == b; break;
+                case EFFECT_VM_OP_NOT:   result = !b; break;
+                case EFFECT_VM_OP_NEG:   result = -b; break;
+                case EFFECT_VM_OP_SIN:   result = sintable[b & 0xFF]; break;
+                case EFFECT_VM_OP_RAND:  result = rands[b & 0xFF]; break;
+                case EFFECT_VM_OP_HSV:
+                    EffectVmSetColor(colors, stack[sp], EHSVtoHEX(stack[sp + 1], stack[sp + 2], stack[sp + 3]));
+                    continue;
+                case EFFECT_VM_OP_RGB:
+                    EffectVmSetColor(colors, stack[sp], ((uint32_t) (stack[sp + 1] & 0xFF) << 16) | ((stack[sp + 2] & 0xFF) << 8) | (stack[sp + 3] & 0xFF));
+                    continue;
+                case EFFECT_VM_OP_EACH:
+                    if (loop) {
+                        error = EFFECT_VM_ERROR_LOOP;
+                        break;
+                    }
+                    loop = true;
+                    loop_led = 0;
+                    loop_start = pc;
+                    continue;
+                case EFFECT_VM_OP_LED:
+                    if (!loop) {
+                        error = EFFECT_VM_ERROR_LOOP;
+                        break;
+                    }
+                    result = loop_led;
+                    break;
+                case EFFECT_VM_OP_NEXT:
+                    if (!loop) {
+                        error = EFFECT_VM_ERROR_LOOP;
+                        break;
+                    }
+                    if (++loop_led < EFFECT_VM_LEDS) {
+                        pc = loop_start;
+                    } else {
+                        loop = false;
+                    }
+                    continue;
+                case EFFECT_VM_OP_JMP:
+                case EFFECT_VM_OP_JZ:
+                    if (op == EFFECT_VM_OP_JZ && b != 0) {
+                        continue;
+                    }
+                    if ((int32_t) pc + operand < 0 || pc + operand > length) {
+                        error = EFFECT_VM_ERROR_CODE;
+                        break;
+                    }
+                    pc += operand;
+                    continue;
+                case EFFECT_VM_OP_TOUCH:
+                    result = b >= 0 && b < 16 && ((effect_vm_state.input[EFFECT_VM_IN_TOUCH] >> b) & 1);
+                    break;
+            }
+            if (error != EFFECT_VM_OK) {
+                break;
+            }
+            stack[sp++] = result;
+        }
+    }
+
+    effect_vm_state.input[EFFECT_VM_IN_FRAME]++;
+    effect_vm_state.steps = steps;
+    effect_vm_state.error = error;
+    return error;
+}
+
+#endif
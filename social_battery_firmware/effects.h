@@ -0,0 +1,394 @@
+/*
+ * Single-File-Header for the LED effects
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 Renze Nicolai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Every effect is an entry in the effects table, keyed by the system mode that
+// selects it. An effect has three callbacks:
+//
+//   - init: called when the effect is selected or restarted, optional
+//   - step: renders a frame into context->leds
+//   - on_touch: called after every touch scan, optional
+//
+// Effects only see the context they are passed and their own state, so they
+// run unchanged on the host, see tools/effect_bench.c. The LED buffer keeps
+// its contents from one frame to the next.
+//
+// To add an effect, write its callbacks and add it to the table. The button
+// cycles through the effects with EFFECT_FLAG_BUTTON in table order.
+
+#ifndef __EFFECTS_H
+#define __EFFECTS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "color_utilities.h"
+#include "slider.h"
+#include "animation.h"
+#include "effect_vm.h"
+
+#define EFFECT_LEDS 5
+
+// System modes of the effects, these are part of the I2C interface
+#define EFFECT_MODE_SOCIAL_BATTERY   1
+#define EFFECT_MODE_RAINBOW          2
+#define EFFECT_MODE_TRANS            3
+#define EFFECT_MODE_DUTCH            4
+#define EFFECT_MODE_KNIGHTRIDER_RED  5
+#define EFFECT_MODE_KNIGHTRIDER_GRN  6
+#define EFFECT_MODE_KNIGHTRIDER_BLU  7
+#define EFFECT_MODE_PARTY            8
+#define EFFECT_MODE_CATS             9
+#define EFFECT_MODE_ANIMATION        12 // Plays the animation set with SetupAnimation()
+#define EFFECT_MODE_PROGRAM          13 // Runs the effect program set with SetupEffectVm()
+
+// Flags
+#define EFFECT_FLAG_BUTTON   0x01 // Selectable with the button
+#define EFFECT_FLAG_UPLOADED 0x02 // Plays data uploaded by the host
+
+#define EFFECT_DEFAULT_RAINBOW_SPEED     15
+#define EFFECT_DEFAULT_KNIGHTRIDER_SPEED (0xFF - 10)
+
+typedef struct {
+    uint32_t now;            // ms
+    uint8_t touch;           // Bitmask of pressed touch pads
+    bool slider_contact;
+    uint8_t slider_position;
+    uint8_t gesture;         // SLIDER_GESTURE_* of the last touch scan, on_touch only
+    uint8_t social_level;    // 0-4
+    volatile uint8_t* leds;  // G, R, B for every LED
+} effect_context_t;
+
+typedef struct _effect effect_t;
+typedef void (*effect_callback_t)(const effect_t* effect, effect_context_t* context);
+
+struct _effect {
+    uint8_t mode;
+    uint8_t flags;
+    uint8_t param;              // For effects that share callbacks, e.g. the knightrider color channel
+    effect_callback_t init;
+    effect_callback_t step;
+    effect_callback_t on_touch;
+};
+
+// Set an LED to a color from EHSVtoHEX() or TweenHexColors()
+static void EffectSetColor(effect_context_t* context, uint8_t led, uint32_t color) {
+    context->leds[(led * 3) + 0] = (color >>  8) & 0xFF;
+    context->leds[(led * 3) + 1] = (color >> 16) & 0xFF;
+    context->leds[(led * 3) + 2] = (color >>  0) & 0xFF;
+}
+
+static void EffectSetLeds(effect_context_t* context, const uint8_t* data) {
+    for (uint8_t i = 0; i < EFFECT_LEDS * 3; i++) {
+        context->leds[i] = data[i];
+    }
+}
+
+static bool EffectTouched(effect_context_t* context, uint8_t pad) {
+    return (context->touch >> pad) & 1;
+}
+
+// Social battery
+
+void EffectSocialBatteryStep(const effect_t* effect, effect_context_t* context) {
+    uint8_t level = context->social_level;
+    for (uint8_t i = 0; i < EFFECT_LEDS; i++) {
+        if (level < i) {
+            context->leds[(i * 3) + 0] = 0;
+            context->leds[(i * 3) + 1] = 0;
+        } else {
+            context->leds[(i * 3) + 0] = 50 * level;
+            context->leds[(i * 3) + 1] = 0xFF - 50 * level;
+        }
+        context->leds[(i * 3) + 2] = EffectTouched(context, i) ? 0xFF : 0x00;
+    }
+}
+
+// Rainbow, dragging along the slider changes the speed and a double tap resets it
+
+struct _effect_rainbow_state {
+    uint8_t hue;
+    uint8_t speed;
+    bool dragging;
+    uint8_t drag_position; // Slider position at the start of a drag
+    uint8_t drag_speed;    // Speed at the start of a drag
+} effect_rainbow_state;
+
+void EffectRainbowInit(const effect_t* effect, effect_context_t* context) {
+    effect_rainbow_state.dragging = false;
+}
+
+void EffectRainbowTouch(const effect_t* effect, effect_context_t* context) {
+    if (context->gesture == SLIDER_GESTURE_DOUBLE_TAP) {
+        effect_rainbow_state.speed = EFFECT_DEFAULT_RAINBOW_SPEED;
+    }
+    if (context->slider_contact) {
+        if (!effect_rainbow_state.dragging) {
+            effect_rainbow_state.dragging = true;
+            effect_rainbow_state.drag_position = context->slider_position;
+            effect_rainbow_state.drag_speed = effect_rainbow_state.speed;
+        }
+        int16_t speed = effect_rainbow_state.drag_speed + ((int16_t) context->slider_position - effect_rainbow_state.drag_position) / 4;
+        effect_rainbow_state.speed = speed < 0 ? 0 : (speed > 0xFF ? 0xFF : speed);
+    } else {
+        effect_rainbow_state.dragging = false;
+    }
+}
+
+void EffectRainbowStep(const effect_t* effect, effect_context_t* context) {
+    for (uint8_t led = 0; led < EFFECT_LEDS; led++) {
+        EffectSetColor(context, led, EHSVtoHEX(effect_rainbow_state.hue + (led * effect_rainbow_state.speed), 240, 128));
+        if (EffectTouched(context, led)) {
+            EffectSetColor(context, led, 0xFFFFFF);
+        }
+    }
+    effect_rainbow_state.hue++;
+}
+
+// Flags, the colors are G, R, B
+
+const uint8_t effect_trans_colors[EFFECT_LEDS * 3] = {
+    0, 0, 255,
+    150, 255, 174,
+    255, 255, 255,
+    150, 255, 174,
+    0, 0, 255,
+};
+
+const uint8_t effect_dutch_colors[EFFECT_LEDS * 3] = {
+    0, 255, 0,
+    0, 255, 0,
+    255, 255, 255,
+    0, 0, 255,
+    0, 0, 255,
+};
+
+struct _effect_trans_state {
+    uint8_t hue;
+} effect_trans_state;
+
+// Touching a pad swaps its pink and blue, the one in the middle becomes a rainbow
+void EffectTransStep(const effect_t* effect, effect_context_t* context) {
+    EffectSetLeds(context, effect_trans_colors);
+    for (uint8_t led = 0; led < EFFECT_LEDS; led++) {
+        if (!EffectTouched(context, led)) {
+            continue;
+        }
+        if (led == 2) {
+            EffectSetColor(context, led, EHSVtoHEX(effect_trans_state.hue, 240, 128));
+            effect_trans_state.hue += 10;
+        } else {
+            uint8_t swap = (led == 0 || led == 3) ? led + 1 : led - 1;
+            for (uint8_t i = 0; i < 3; i++) {
+                context->leds[(led * 3) + i] = effect_trans_colors[(swap * 3) + i];
+            }
+        }
+    }
+}
+
+void EffectDutchStep(const effect_t* effect, effect_context_t* context) {
+    EffectSetLeds(context, effect_dutch_colors);
+}
+
+// Knightrider, the parameter is the color channel
+
+struct _effect_knightrider_state {
+    uint8_t speed;
+    uint8_t led;
+    uint16_t value;
+    bool direction;
+} effect_knightrider_state;
+
+void EffectKnightriderStep(const effect_t* effect, effect_context_t* context) {
+    volatile uint8_t* leds = context->leds;
+    for (uint8_t i = 0; i < EFFECT_LEDS * 3; i++) {
+        if (leds[i] > 10) {
+            leds[i] -= 10;
+        } else {
+            leds[i] = 0;
+        }
+    }
+
+    if (effect_knightrider_state.value > (0xFF - effect_knightrider_state.speed)) {
+        effect_knightrider_state.value = 0;
+        if (!effect_knightrider_state.direction) {
+            effect_knightrider_state.led++;
+            if (effect_knightrider_state.led >= EFFECT_LEDS - 1) {
+                effect_knightrider_state.direction = true;
+            }
+        } else {
+            effect_knightrider_state.led--;
+            if (effect_knightrider_state.led == 0) {
+                effect_knightrider_state.direction = false;
+            }
+        }
+    } else {
+        effect_knightrider_state.value++;
+    }
+
+    uint8_t index = (effect_knightrider_state.led * 3) + effect->param;
+    if (leds[index] < 215) {
+        leds[index] += 50;
+    } else {
+        leds[index] = 255;
+    }
+}
+
+// Party animals, all white and a touched pad shows the next color of the rainbow
+
+struct _effect_party_state {
+    uint8_t hue;
+} effect_party_state;
+
+void EffectPartyStep(const effect_t* effect, effect_context_t* context) {
+    for (uint8_t led = 0; led < EFFECT_LEDS; led++) {
+        EffectSetColor(context, led, 0xFFFFFF);
+        if (EffectTouched(context, led)) {
+            EffectSetColor(context, led, EHSVtoHEX(effect_party_state.hue, 240, 128));
+            effect_party_state.hue += 10;
+        }
+    }
+}
+
+// Moving cats, a single LED at the social level, which follows the last touched pad
+
+struct _effect_cats_state {
+    uint8_t hue;
+} effect_cats_state;
+
+void EffectCatsStep(const effect_t* effect, effect_context_t* context) {
+    for (uint8_t led = 0; led < EFFECT_LEDS; led++) {
+        EffectSetColor(context, led, 0);
+    }
+    EffectSetColor(context, context->social_level, EHSVtoHEX(effect_cats_state.hue, 240, 128));
+    effect_cats_state.hue += 10;
+}
+
+// Uploaded animation
+
+struct _effect_animation_state {
+    volatile bool trigger; // Trigger the animation at the next frame
+} effect_animation_state;
+
+void EffectAnimationInit(const effect_t* effect, effect_context_t* context) {
+    RestartAnimation(context->now);
+}
+
+void EffectAnimationStep(const effect_t* effect, effect_context_t* context) {
+    if (effect_animation_state.trigger) {
+        effect_animation_state.trigger = false;
+        TriggerAnimation(context->now);
+    }
+    uint32_t colors[EFFECT_LEDS];
+    if (!RenderAnimation(context->now, colors)) {
+        memset(colors, 0, sizeof(colors));
+    }
+    for (uint8_t led = 0; led < EFFECT_LEDS; led++) {
+        EffectSetColor(context, led, colors[led]);
+    }
+}
+
+// Uploaded effect program, limited to EFFECT_VM_BUDGET instructions per frame
+
+struct _effect_program_state {
+    uint32_t start;                // ms
+    uint32_t colors[EFFECT_LEDS];  // Kept from frame to frame, a program can leave LEDs unchanged
+} effect_program_state;
+
+void EffectProgramInit(const effect_t* effect, effect_context_t* context) {
+    RestartEffectVm();
+    effect_program_state.start = context->now;
+    memset(effect_program_state.colors, 0, sizeof(effect_program_state.colors));
+}
+
+void EffectProgramStep(const effect_t* effect, effect_context_t* context) {
+    SetEffectVmInput(EFFECT_VM_IN_TIME, context->now - effect_program_state.start);
+    SetEffectVmInput(EFFECT_VM_IN_TOUCH, context->touch);
+    SetEffectVmInput(EFFECT_VM_IN_SLIDER, context->slider_position);
+    SetEffectVmInput(EFFECT_VM_IN_CONTACT, context->slider_contact);
+    SetEffectVmInput(EFFECT_VM_IN_SOCIAL, context->social_level);
+    RunEffectVm(effect_program_state.colors);
+    for (uint8_t led = 0; led < EFFECT_LEDS; led++) {
+        EffectSetColor(context, led, effect_program_state.colors[led]);
+    }
+}
+
+const effect_t effects[] = {
+    {EFFECT_MODE_SOCIAL_BATTERY,  EFFECT_FLAG_BUTTON,   0, NULL,                EffectSocialBatteryStep, NULL},
+    {EFFECT_MODE_RAINBOW,         EFFECT_FLAG_BUTTON,   0, EffectRainbowInit,   EffectRainbowStep,       EffectRainbowTouch},
+    {EFFECT_MODE_TRANS,           EFFECT_FLAG_BUTTON,   0, NULL,                EffectTransStep,         NULL},
+    {EFFECT_MODE_DUTCH,           EFFECT_FLAG_BUTTON,   0, NULL,                EffectDutchStep,         NULL},
+    {EFFECT_MODE_KNIGHTRIDER_RED, EFFECT_FLAG_BUTTON,   1, NULL,                EffectKnightriderStep,   NULL},
+    {EFFECT_MODE_KNIGHTRIDER_GRN, EFFECT_FLAG_BUTTON,   0, NULL,                EffectKnightriderStep,   NULL},
+    {EFFECT_MODE_KNIGHTRIDER_BLU, EFFECT_FLAG_BUTTON,   2, NULL,                EffectKnightriderStep,   NULL},
+    {EFFECT_MODE_PARTY,           EFFECT_FLAG_BUTTON,   0, NULL,                EffectPartyStep,         NULL},
+    {EFFECT_MODE_CATS,            EFFECT_FLAG_BUTTON,   0, NULL,                EffectCatsStep,          NULL},
+    {EFFECT_MODE_ANIMATION,       EFFECT_FLAG_UPLOADED, 0, EffectAnimationInit, EffectAnimationStep,     NULL},
+    {EFFECT_MODE_PROGRAM,         EFFECT_FLAG_UPLOADED, 0, EffectProgramInit,   EffectProgramStep,       NULL},
+};
+
+#define NUM_EFFECTS (sizeof(effects) / sizeof(effects[0]))
+
+void SetupEffects() {
+    effect_rainbow_state.speed = EFFECT_DEFAULT_RAINBOW_SPEED;
+    effect_knightrider_state.speed = EFFECT_DEFAULT_KNIGHTRIDER_SPEED;
+}
+
+// Returns NULL if no effect has this mode
+const effect_t* FindEffect(uint8_t mode) {
+    for (uint8_t i = 0; i < NUM_EFFECTS; i++) {
+        if (effects[i].mode == mode) {
+            return &effects[i];
+        }
+    }
+    return NULL;
+}
+
+// The mode the button switches to, modes that are not in the cycle go to the first one
+uint8_t NextEffectMode(uint8_t mode) {
+    uint8_t first = NUM_EFFECTS;
+    bool found = false;
+    for (uint8_t i = 0; i < NUM_EFFECTS; i++) {
+        if (!(effects[i].flags & EFFECT_FLAG_BUTTON)) {
+            continue;
+        }
+        if (found) {
+            return effects[i].mode;
+        }
+        if (first == NUM_EFFECTS) {
+            first = i;
+        }
+        found = effects[i].mode == mode;
+    }
+    return first < NUM_EFFECTS ? effects[first].mode : mode;
+}
+
+void StartEffect(const effect_t* effect, effect_context_t* context) {
+    if (effect->init) {
+        effect->init(effect, context);
+    }
+}
+
+#endif
@@ -0,0 +1,106 @@
+/*
+ * Single-File-Header for a queue of timestamped input events
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 Renze Nicolai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Ring buffer with a single producer (the main loop) and a single consumer (the
+// I2C interrupt handler). Only the producer writes head and only the consumer
+// writes tail, so no locking is needed. When the queue is full new events are
+// dropped and counted as overflow.
+//
+// Every event is four bytes: the event type in the upper and the source in the
+// lower nibble of the first byte, followed by a 24-bit timestamp in milliseconds.
+
+#ifndef __EVENT_QUEUE_H
+#define __EVENT_QUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef EVENT_QUEUE_SIZE
+#define EVENT_QUEUE_SIZE 16 // Must be a power of two
+#endif
+
+#define EVENT_SIZE 4
+
+#define EVENT_NONE        0
+#define EVENT_PRESS       1
+#define EVENT_RELEASE     2
+#define EVENT_LONG_PRESS  3
+#define EVENT_TAP         4
+#define EVENT_DOUBLE_TAP  5
+#define EVENT_SWIPE_LEFT  6
+#define EVENT_SWIPE_RIGHT 7
+
+typedef struct {
+    uint8_t data[EVENT_SIZE];
+} event_t;
+
+struct _event_queue_state {
+    event_t events[EVENT_QUEUE_SIZE];
+    volatile uint8_t head;
+    volatile uint8_t tail;
+    volatile uint8_t overflow; // Saturates at 255
+} event_queue_state;
+
+uint8_t GetEventCount() {
+    return (uint8_t) (event_queue_state.head - event_queue_state.tail);
+}
+
+bool PushEvent(uint8_t type, uint8_t source, uint32_t timestamp) {
+    if (GetEventCount() >= EVENT_QUEUE_SIZE) {
+        if (event_queue_state.overflow < 0xFF) {
+            event_queue_state.overflow++;
+        }
+        return false;
+    }
+    event_t* event = &event_queue_state.events[event_queue_state.head & (EVENT_QUEUE_SIZE - 1)];
+    event->data[0] = (type << 4) | (source & 0x0F);
+    event->data[1] = (timestamp      ) & 0xFF;
+    event->data[2] = (timestamp >>  8) & 0xFF;
+    event->data[3] = (timestamp >> 16) & 0xFF;
+    event_queue_state.head++;
+    return true;
+}
+
+// Event at position index from the oldest event, index must be below GetEventCount()
+const event_t* PeekEvent(uint8_t index) {
+    return &event_queue_state.events[(event_queue_state.tail + index) & (EVENT_QUEUE_SIZE - 1)];
+}
+
+void PopEvent() {
+    if (GetEventCount() > 0) {
+        event_queue_state.tail++;
+    }
+}
+
+uint8_t GetEventOverflow() {
+    return event_queue_state.overflow;
+}
+
+void ClearEventOverflow() {
+    event_queue_state.overflow = 0;
+}
+
+#endif
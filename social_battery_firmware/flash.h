@@ -0,0 +1,83 @@
+/*
+ * Single-File-Header for erasing and programming the internal flash
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 Renze Nicolai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Pages of FLASH_PAGE_SIZE bytes are erased with the fast page erase, data is
+// programmed a half-word at a time. The CPU stalls while the flash is busy, so
+// interrupts are delayed during an erase. Storage areas are declared as const
+// arrays with FLASH_STORAGE, aligned to FLASH_PAGE_SIZE, which keeps the linker
+// from placing code in them. They must not be declared volatile: GCC places
+// volatile objects in .data even when they are const, which would put a copy of
+// them in RAM. Read them through a const volatile pointer instead, so the
+// compiler does not replace the reads with the initial values.
+//
+// Depending on the chip an erased half-word does not necessarily read as
+// 0xFFFF, users of this header should read back the erased value instead of
+// assuming it.
+
+#ifndef __FLASH_H
+#define __FLASH_H
+
+#include "ch32v003fun.h"
+#include <stdint.h>
+
+#define FLASH_PAGE_SIZE 64
+
+#define FLASH_STORAGE __attribute__((aligned(FLASH_PAGE_SIZE)))
+
+void UnlockFlash() {
+    FLASH->KEYR = FLASH_KEY1;
+    FLASH->KEYR = FLASH_KEY2;
+    FLASH->MODEKEYR = FLASH_KEY1; // Fast page erase
+    FLASH->MODEKEYR = FLASH_KEY2;
+}
+
+void LockFlash() {
+    FLASH->CTLR = FLASH_CTLR_LOCK | FLASH_CTLR_FLOCK;
+}
+
+static void FlashWait() {
+    while (FLASH->STATR & FLASH_STATR_BSY);
+    FLASH->STATR = FLASH_STATR_EOP;
+}
+
+// Erase the page starting at address, the flash must be unlocked
+void EraseFlashPage(uint32_t address) {
+    FLASH->CTLR = FLASH_CTLR_PAGE_ER;
+    FLASH->ADDR = address;
+    FLASH->CTLR = FLASH_CTLR_PAGE_ER | FLASH_CTLR_STRT;
+    FlashWait();
+    FLASH->CTLR = 0;
+}
+
+// Program a half-word that has been erased before, the flash must be unlocked
+void ProgramFlashHalfWord(uint32_t address, uint16_t value) {
+    FLASH->CTLR = FLASH_CTLR_PG;
+    *(volatile uint16_t*) address = value;
+    FlashWait();
+    FLASH->CTLR = 0;
+}
+
+#endif
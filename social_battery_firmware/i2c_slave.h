@@ -31,29 +31,89 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 
-typedef void (*i2c_write_callback_t)(uint8_t reg, uint8_t length);
-typedef void (*i2c_read_callback_t)(uint8_t reg);
+typedef void (*i2c_write_callback_t)(uint16_t reg, uint16_t length);
+typedef void (*i2c_read_callback_t)(uint16_t reg);
+typedef void (*i2c_read_done_callback_t)(uint16_t reg, uint16_t length);
+
+// With I2C_SLAVE_USE_DMA defined the data phase of a transaction is handled by
+// DMA1 channel 6 (transmit) and channel 7 (receive) instead of an interrupt per
+// byte. Received bytes are collected in a small buffer that is handled at the end
+// of the transaction, or whenever it is full. Reads are sent straight from the
+// registers, except for addresses with a read callback. The ADDR and STOPF events
+// and the transfer complete interrupts still take handler time, whether this is
+// less than the byte by byte path has not been measured yet, compare
+// GetI2CSlaveTimePerByte() for both builds.
+#ifndef I2C_SLAVE_DMA_BUFFER
+#define I2C_SLAVE_DMA_BUFFER 16
+#endif
+
+// Write handler for a range of registers of the primary address. After a write the
+// handler is called once with the span of dirty registers within its range.
+typedef struct {
+    uint16_t first;
+    uint16_t last; // Inclusive
+    i2c_write_callback_t callback;
+} i2c_write_handler_t;
+
+// Range of registers of the primary address that is double buffered, see SetI2CSlaveShadow()
+typedef struct {
+    uint16_t first;
+    uint16_t last; // Inclusive
+} i2c_shadow_range_t;
 
 struct _i2c_slave_state {
-    uint8_t first_write;
-    uint8_t offset;
-    uint8_t position;
+    uint8_t first_write; // Number of offset bytes still to be received
+    uint16_t offset;
+    uint16_t position;
     volatile uint8_t* volatile registers1;
-    uint8_t size1;
+    uint16_t size1;
     volatile uint8_t* volatile registers2;
-    uint8_t size2;
+    uint16_t size2;
+    uint8_t page_size2; // Writes wrap around within pages of this size, 0 to disable
     i2c_write_callback_t write_callback1;
     i2c_read_callback_t read_callback1;
+    uint16_t read_first1; // Registers for which the read callback has to run
+    uint16_t read_last1;
     bool read_only1;
+    bool wide1;         // 16-bit register offsets
+    volatile uint8_t* shadow1; // Second bank of the shadow ranges, NULL when not double buffered
+    const i2c_shadow_range_t* shadow_ranges1;
+    uint8_t shadow_range_count1;
+    volatile bool shadow_published1; // The second bank is served to reads
+    bool read_shadow1;               // The current read transaction is served from the second bank
+    i2c_read_done_callback_t read_done_callback1;
+    bool reading;        // A read of the primary address has not been completed yet
+    uint16_t read_count; // Bytes loaded for the host in that read
     i2c_write_callback_t write_callback2;
     i2c_read_callback_t read_callback2;
     bool read_only2;
+    volatile uint8_t* write_buffer2; // Page buffer for writes, NULL to write the registers directly
+    uint8_t write_count2;            // Bytes received in the current write
+    volatile uint8_t* window2;       // Serves reads of the registers from window_first2 on
+    uint16_t window_first2;
+    uint16_t window_size2;
+    bool wide2;
     bool writing;
     bool address2matched;
+    uint16_t dirty_first; // Registers written since the last dispatch, none when first > last
+    uint16_t dirty_last;
+    const i2c_write_handler_t* handlers;
+    uint8_t handler_count;
+    uint32_t lock_start;
+    uint32_t lock_max_time; // Longest time the event interrupt was masked (SysTick ticks)
+    uint32_t isr_max_time;  // Longest time spent in one of the interrupt handlers (SysTick ticks)
+    uint32_t isr_total_time; // Time spent in the interrupt handlers (SysTick ticks)
+    uint32_t bytes;          // Bytes transferred in that time
+#ifdef I2C_SLAVE_USE_DMA
+    bool dma;                // The data phase of the current transaction is handled by DMA
+    uint16_t dma_count;      // Length of the current transmit DMA transfer, 0 when idle
+    uint8_t dma_buffer[I2C_SLAVE_DMA_BUFFER];
+#endif
 } i2c_slave_state;
 
-void SetupI2CSlave(uint8_t address, volatile uint8_t* registers, uint8_t size, i2c_write_callback_t write_callback, i2c_read_callback_t read_callback, bool read_only) {
+void SetupI2CSlave(uint8_t address, volatile uint8_t* registers, uint16_t size, i2c_write_callback_t write_callback, i2c_read_callback_t read_callback, bool read_only) {
     i2c_slave_state.first_write = 1;
     i2c_slave_state.offset = 0;
     i2c_slave_state.position = 0;
@@ -61,12 +121,33 @@ void SetupI2CSlave(uint8_t address, volatile uint8_t* registers, uint8_t size, i
     i2c_slave_state.size1 = size;
     i2c_slave_state.registers2 = NULL;
     i2c_slave_state.size2 = 0;
+    i2c_slave_state.page_size2 = 0;
     i2c_slave_state.write_callback1 = write_callback;
     i2c_slave_state.read_callback1 = read_callback;
+    i2c_slave_state.read_first1 = 0;
+    i2c_slave_state.read_last1 = size - 1;
     i2c_slave_state.read_only1 = read_only;
+    i2c_slave_state.shadow1 = NULL;
+    i2c_slave_state.shadow_range_count1 = 0;
+    i2c_slave_state.shadow_published1 = false;
+    i2c_slave_state.read_shadow1 = false;
+    i2c_slave_state.read_done_callback1 = NULL;
+    i2c_slave_state.reading = false;
     i2c_slave_state.write_callback2 = NULL;
     i2c_slave_state.read_callback2 = NULL;
     i2c_slave_state.read_only2 = false;
+    i2c_slave_state.write_buffer2 = NULL;
+    i2c_slave_state.window2 = NULL;
+    i2c_slave_state.wide1 = false;
+    i2c_slave_state.wide2 = false;
+    i2c_slave_state.handlers = NULL;
+    i2c_slave_state.handler_count = 0;
+    i2c_slave_state.dirty_first = 1;
+    i2c_slave_state.dirty_last = 0;
+    i2c_slave_state.lock_max_time = 0;
+    i2c_slave_state.isr_max_time = 0;
+    i2c_slave_state.isr_total_time = 0;
+    i2c_slave_state.bytes = 0;
 
     // Enable I2C1
     RCC->APB1PCENR |= RCC_APB1Periph_I2C1;
@@ -83,7 +164,32 @@ void SetupI2CSlave(uint8_t address, volatile uint8_t* registers, uint8_t size, i
     I2C1->CTLR2 |= (FUNCONF_SYSTEM_CORE_CLOCK/prerate) & I2C_CTLR2_FREQ;
 
     // Enable interrupts
+#ifdef I2C_SLAVE_USE_DMA
+    I2C1->CTLR2 |= I2C_CTLR2_ITEVTEN | I2C_CTLR2_ITERREN | I2C_CTLR2_DMAEN;
+    i2c_slave_state.dma = true;
+    i2c_slave_state.dma_count = 0;
+
+    RCC->AHBPCENR |= RCC_AHBPeriph_DMA1;
+
+    DMA1_Channel6->CFGR = 0;
+    DMA1_Channel6->PADDR = (uint32_t) &I2C1->DATAR;
+    DMA1_Channel6->CFGR = DMA_M2M_Disable | DMA_Priority_High | DMA_MemoryDataSize_Byte | DMA_PeripheralDataSize_Byte |
+                          DMA_MemoryInc_Enable | DMA_Mode_Normal | DMA_DIR_PeripheralDST | DMA_IT_TC;
+
+    DMA1_Channel7->CFGR = 0;
+    DMA1_Channel7->PADDR = (uint32_t) &I2C1->DATAR;
+    DMA1_Channel7->MADDR = (uint32_t) i2c_slave_state.dma_buffer;
+    DMA1_Channel7->CNTR = sizeof(i2c_slave_state.dma_buffer);
+    DMA1_Channel7->CFGR = DMA_M2M_Disable | DMA_Priority_High | DMA_MemoryDataSize_Byte | DMA_PeripheralDataSize_Byte |
+                          DMA_MemoryInc_Enable | DMA_Mode_Normal | DMA_DIR_PeripheralSRC | DMA_IT_TC | DMA_CFGR1_EN;
+
+    NVIC_EnableIRQ(DMA1_Channel6_IRQn);
+    NVIC_SetPriority(DMA1_Channel6_IRQn, 2 << 4); // Same as the I2C interrupts, they do not preempt each other
+    NVIC_EnableIRQ(DMA1_Channel7_IRQn);
+    NVIC_SetPriority(DMA1_Channel7_IRQn, 2 << 4);
+#else
     I2C1->CTLR2 |= I2C_CTLR2_ITBUFEN | I2C_CTLR2_ITEVTEN | I2C_CTLR2_ITERREN;
+#endif
 
     NVIC_EnableIRQ(I2C1_EV_IRQn); // Event interrupt
     NVIC_SetPriority(I2C1_EV_IRQn, 2 << 4);
@@ -107,7 +213,7 @@ void SetupI2CSlave(uint8_t address, volatile uint8_t* registers, uint8_t size, i
     I2C1->CTLR1 |= I2C_CTLR1_ACK;
 }
 
-void SetupSecondaryI2CSlave(uint8_t address, volatile uint8_t* registers, uint8_t size, i2c_write_callback_t write_callback, i2c_read_callback_t read_callback, bool read_only) {
+void SetupSecondaryI2CSlave(uint8_t address, volatile uint8_t* registers, uint16_t size, i2c_write_callback_t write_callback, i2c_read_callback_t read_callback, bool read_only) {
     if (address > 0) {
         I2C1->OADDR2 = (address << 1) | 1;
         i2c_slave_state.registers2 = registers;
@@ -128,77 +234,526 @@ void SetSecondaryI2CSlaveReadOnly(bool read_only) {
     i2c_slave_state.read_only2 = read_only;
 }
 
-void I2C1_EV_IRQHandler(void) __attribute__((interrupt));
-void I2C1_EV_IRQHandler(void) {
-    uint16_t STAR1, STAR2 __attribute__((unused));
-    STAR1 = I2C1->STAR1;
-    STAR2 = I2C1->STAR2;
-
-    if (STAR1 & I2C_STAR1_ADDR) { // Start event
-        i2c_slave_state.first_write = 1; // Next write will be the offset
-        i2c_slave_state.position = i2c_slave_state.offset; // Reset position
-        i2c_slave_state.address2matched = !!(STAR2 & I2C_STAR2_DUALF);
+// Double buffer ranges of registers of the primary address. The application writes
+// its values into the back bank and makes them visible to the host all at once with
+// PublishI2CSlaveRegisters(). A read transaction is served from the bank that was
+// published when it was addressed, so the values read together always belong to
+// the same snapshot. Registers outside of the ranges have a single bank. Writes by
+// the host go to both banks, as must updates made outside of a snapshot, see
+// SetI2CSlaveRegister().
+//
+// The ranges must be in ascending order. shadow holds the second bank of every range,
+// one after the other, so it must be as large as the ranges together. The back bank
+// is not a copy of the published one, the application rewrites all of its values
+// for every snapshot.
+void SetI2CSlaveShadow(volatile uint8_t* shadow, const i2c_shadow_range_t* ranges, uint8_t count) {
+    uint16_t index = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        for (uint16_t reg = ranges[i].first; reg <= ranges[i].last; reg++) {
+            shadow[index++] = i2c_slave_state.registers1[reg];
+        }
     }
+    i2c_slave_state.shadow_published1 = false;
+    i2c_slave_state.shadow_ranges1 = ranges;
+    i2c_slave_state.shadow_range_count1 = count;
+    i2c_slave_state.shadow1 = shadow;
+}
 
-    if (STAR1 & I2C_STAR1_RXNE) { // Write event
-        if (i2c_slave_state.first_write) { // First byte written, set the offset
-            i2c_slave_state.offset = I2C1->DATAR;
-            i2c_slave_state.position = i2c_slave_state.offset;
-            i2c_slave_state.first_write = 0;
-            i2c_slave_state.writing = false;
-        } else { // Normal register write
-            i2c_slave_state.writing = true;
-            if (i2c_slave_state.address2matched) {
-                if (i2c_slave_state.position < i2c_slave_state.size2 && !i2c_slave_state.read_only2) {
-                    i2c_slave_state.registers2[i2c_slave_state.position] = I2C1->DATAR;
-                    i2c_slave_state.position++;
-                }
-            } else {
-                if (i2c_slave_state.position < i2c_slave_state.size1 && !i2c_slave_state.read_only1) {
-                    i2c_slave_state.registers1[i2c_slave_state.position] = I2C1->DATAR;
-                    i2c_slave_state.position++;
-                }
+// Second bank address of a register, NULL when it is not double buffered. When
+// end is given it is set to the end of the run of registers with the same bank.
+static volatile uint8_t* I2CSlaveShadowRegister(uint16_t reg, uint16_t* end) {
+    uint16_t index = 0;
+    for (uint8_t i = 0; i < i2c_slave_state.shadow_range_count1; i++) {
+        const i2c_shadow_range_t* range = &i2c_slave_state.shadow_ranges1[i];
+        if (reg < range->first) {
+            if (end != NULL) {
+                *end = range->first;
             }
+            return NULL;
         }
+        if (reg <= range->last) {
+            if (end != NULL) {
+                *end = range->last + 1;
+            }
+            return &i2c_slave_state.shadow1[index + reg - range->first];
+        }
+        index += range->last - range->first + 1;
+    }
+    if (end != NULL) {
+        *end = i2c_slave_state.size1;
     }
+    return NULL;
+}
 
-    if (STAR1 & I2C_STAR1_TXE) { // Read event
+// True while a read is still served from the back bank, which then must not be rewritten
+bool I2CSlaveBackBufferBusy() {
+    return i2c_slave_state.reading && i2c_slave_state.read_shadow1 != i2c_slave_state.shadow_published1;
+}
+
+// Register in the bank to write the next snapshot into. Check I2CSlaveBackBufferBusy()
+// before writing a snapshot. For registers outside of the shadow ranges this is the
+// register itself.
+volatile uint8_t* GetI2CSlaveBackRegister(uint16_t reg) {
+    if (i2c_slave_state.shadow1 != NULL && !i2c_slave_state.shadow_published1) {
+        volatile uint8_t* shadow = I2CSlaveShadowRegister(reg, NULL);
+        if (shadow != NULL) {
+            return shadow;
+        }
+    }
+    return &i2c_slave_state.registers1[reg];
+}
+
+// Serve the back bank to the following read transactions, a single store so
+// the interrupt never sees a partial update
+void PublishI2CSlaveRegisters() {
+    if (i2c_slave_state.shadow1 != NULL) {
+        i2c_slave_state.shadow_published1 = !i2c_slave_state.shadow_published1;
+    }
+}
+
+// Update a register in both banks, for values that change outside of a snapshot
+void SetI2CSlaveRegister(uint16_t reg, uint8_t value) {
+    if (i2c_slave_state.registers1 == NULL) {
+        return; // Not set up
+    }
+    i2c_slave_state.registers1[reg] = value;
+    volatile uint8_t* shadow = I2CSlaveShadowRegister(reg, NULL);
+    if (shadow != NULL) {
+        *shadow = value;
+    }
+}
+
+// Address of a register in the bank of the current read, and in end the end of the
+// run of registers that can be read from there
+static volatile uint8_t* I2CSlaveReadRegister(uint16_t reg, uint16_t* end) {
+    volatile uint8_t* shadow = I2CSlaveShadowRegister(reg, end);
+    if (shadow != NULL && i2c_slave_state.read_shadow1) {
+        return shadow;
+    }
+    return &i2c_slave_state.registers1[reg];
+}
+
+// Limit the registers of the primary address the read callback needs to see, so
+// reads of the other registers can be done by DMA
+void SetI2CSlaveReadCallbackRange(uint16_t first, uint16_t last) {
+    i2c_slave_state.read_first1 = first;
+    i2c_slave_state.read_last1 = last;
+}
+
+// Callback for the end of a read of the primary address, with the registers the
+// host has received. The byte that was loaded last is not counted: the slave loads
+// a byte before the host clocks it out and the host ends a read by not
+// acknowledging the byte before it. If a byte was not loaded in time the callback
+// sees one byte less than the host received, never more.
+void SetI2CSlaveReadDoneCallback(i2c_read_done_callback_t callback) {
+    i2c_slave_state.read_done_callback1 = callback;
+}
+
+// Register write handlers for the primary address. They are
+// called from the interrupt handler at the end of every write, before the write callback.
+void SetI2CSlaveWriteHandlers(const i2c_write_handler_t* handlers, uint8_t count) {
+    i2c_slave_state.handlers = handlers;
+    i2c_slave_state.handler_count = count;
+}
+
+// Call the handlers of the dirty registers and clear them. The registers written in one
+// write are consecutive, a write that follows a repeated start is dispatched on its own.
+static void I2CSlaveDispatch() {
+    for (uint8_t i = 0; i < i2c_slave_state.handler_count; i++) {
+        const i2c_write_handler_t* handler = &i2c_slave_state.handlers[i];
+        uint16_t first = handler->first > i2c_slave_state.dirty_first ? handler->first : i2c_slave_state.dirty_first;
+        uint16_t last = handler->last < i2c_slave_state.dirty_last ? handler->last : i2c_slave_state.dirty_last;
+        if (first <= last) {
+            handler->callback(first, last - first + 1);
+        }
+    }
+    i2c_slave_state.dirty_first = 1;
+    i2c_slave_state.dirty_last = 0;
+}
+
+// Select 16-bit register offsets, sent MSB first, instead of 8-bit offsets. Takes
+// effect at the next transaction, so it can be changed from a write callback.
+void SetI2CSlaveWideAddressing(bool wide) {
+    i2c_slave_state.wide1 = wide;
+}
+
+void SetSecondaryI2CSlaveWideAddressing(bool wide) {
+    i2c_slave_state.wide2 = wide;
+}
+
+// Make the secondary address behave like a 24Cxx EEPROM: writes wrap around within
+// pages and reads wrap around at the end of the memory. page_size must be a power
+// of two, 0 disables the wrap around. All bytes of a write are in the page of reg,
+// the length passed to the write callback is at most page_size, when it is equal
+// to page_size the write may have wrapped around and the whole page was written.
+void SetSecondaryI2CSlavePageSize(uint8_t page_size) {
+    i2c_slave_state.page_size2 = page_size;
+}
+
+// Collect the bytes written to the secondary address in buffer, at their offset
+// within the page, instead of writing them to the registers, which can then be
+// read-only memory such as flash. The write callback takes them from there. Needs
+// a page size, buffer must be as large as a page.
+void SetSecondaryI2CSlaveWriteBuffer(volatile uint8_t* buffer) {
+    i2c_slave_state.write_buffer2 = buffer;
+}
+
+// Serve reads of size registers of the secondary address from first on from window
+// instead of from the registers, for example a modified copy in RAM. Call it while no
+// transaction can use the secondary address, see SetSecondaryI2CSlaveEnabled().
+void SetSecondaryI2CSlaveWindow(volatile uint8_t* window, uint16_t first, uint16_t size) {
+    i2c_slave_state.window2 = window;
+    i2c_slave_state.window_first2 = first;
+    i2c_slave_state.window_size2 = size;
+}
+
+// Address of a register of the secondary address. When end is given it is set to the
+// end of the run of registers that can be read from there.
+static volatile uint8_t* I2CSlaveSecondaryRegister(uint16_t reg, uint16_t* end) {
+    uint16_t first = i2c_slave_state.window_first2;
+    uint16_t last = first + i2c_slave_state.window_size2;
+    uint16_t run_end = i2c_slave_state.size2;
+    volatile uint8_t* address = &i2c_slave_state.registers2[reg];
+    if (i2c_slave_state.window2 != NULL && reg < last) {
+        if (reg < first) {
+            run_end = first;
+        } else {
+            run_end = last < run_end ? last : run_end;
+            address = &i2c_slave_state.window2[reg - first];
+        }
+    }
+    if (end != NULL) {
+        *end = run_end;
+    }
+    return address;
+}
+
+// While disabled the secondary address is not acknowledged
+void SetSecondaryI2CSlaveEnabled(bool enabled) {
+    if (enabled) {
+        I2C1->OADDR2 |= I2C_OADDR2_ENDUAL;
+    } else {
+        I2C1->OADDR2 &= ~I2C_OADDR2_ENDUAL;
+    }
+}
+
+// Mask the event interrupt while the application updates the registers,
+// the longest time spent masked is recorded for the latency bound
+void I2CSlaveLock() {
+    I2C1->CTLR2 &= ~(I2C_CTLR2_ITEVTEN); // Disable I2C event interrupt
+    i2c_slave_state.lock_start = SysTick->CNT;
+}
+
+void I2CSlaveUnlock() {
+    uint32_t duration = SysTick->CNT - i2c_slave_state.lock_start;
+    if (duration > i2c_slave_state.lock_max_time) {
+        i2c_slave_state.lock_max_time = duration;
+    }
+    I2C1->CTLR2 |= I2C_CTLR2_ITEVTEN; // Enable I2C event interrupt
+}
+
+// Upper-bound estimate of the time between the peripheral requesting service and
+// the handler finishing, in SysTick ticks. This is not a measurement of any bus
+// event: it adds the longest run of the I2C handlers to the longest time an event
+// can be held off, which is the longest of the time spent masked, an I2C handler
+// run and blocked. Pass the longest run of the other handlers that can delay the
+// I2C interrupt as blocked. Short sections with interrupts disabled and handlers
+// that are not passed in are not covered.
+uint32_t GetI2CSlaveLatencyBound(uint32_t blocked) {
+    uint32_t held_off = i2c_slave_state.lock_max_time;
+    if (i2c_slave_state.isr_max_time > held_off) {
+        held_off = i2c_slave_state.isr_max_time;
+    }
+    if (blocked > held_off) {
+        held_off = blocked;
+    }
+    return held_off + i2c_slave_state.isr_max_time;
+}
+
+void ResetI2CSlaveLatency() {
+    i2c_slave_state.lock_max_time = 0;
+    i2c_slave_state.isr_max_time = 0;
+    i2c_slave_state.isr_total_time = 0;
+    i2c_slave_state.bytes = 0;
+}
+
+// Average time spent in the I2C interrupt handlers per transferred byte, in SysTick
+// ticks multiplied by scale (at most 16) before the division. Passing the cycles per
+// tick gives the result in cycles without truncating it to whole ticks first, which
+// matters when a byte costs less than a tick.
+uint32_t GetI2CSlaveTimePerByte(uint32_t scale) {
+    return i2c_slave_state.bytes > 0 ? i2c_slave_state.isr_total_time * scale / i2c_slave_state.bytes : 0;
+}
+
+static void I2CSlaveIsrDone(uint32_t isr_start) {
+    uint32_t isr_duration = SysTick->CNT - isr_start;
+    if (isr_duration > i2c_slave_state.isr_max_time) {
+        i2c_slave_state.isr_max_time = isr_duration;
+    }
+    i2c_slave_state.isr_total_time += isr_duration;
+    if (i2c_slave_state.isr_total_time & 0xF8000000) { // Keep the average, but leave room for the scale
+        i2c_slave_state.isr_total_time >>= 1;
+        i2c_slave_state.bytes >>= 1;
+    }
+}
+
+// Handle a received byte, the offset bytes come first
+static void I2CSlaveReceive(uint8_t value) {
+    i2c_slave_state.bytes++;
+    if (i2c_slave_state.first_write == 2) { // MSB of a 16-bit offset
+        i2c_slave_state.offset = value << 8;
+        i2c_slave_state.first_write = 1;
+        i2c_slave_state.writing = false;
+    } else if (i2c_slave_state.first_write == 1) { // Last byte of the offset
+        bool wide = i2c_slave_state.address2matched ? i2c_slave_state.wide2 : i2c_slave_state.wide1;
+        i2c_slave_state.offset = (wide ? i2c_slave_state.offset : 0) | value;
+        i2c_slave_state.position = i2c_slave_state.offset;
+        i2c_slave_state.first_write = 0;
         i2c_slave_state.writing = false;
+    } else { // Normal register write
+        i2c_slave_state.writing = true;
         if (i2c_slave_state.address2matched) {
-            if (i2c_slave_state.position < i2c_slave_state.size2) {
-                I2C1->DATAR = i2c_slave_state.registers2[i2c_slave_state.position];
-                if (i2c_slave_state.read_callback2 != NULL) {
-                    i2c_slave_state.read_callback2(i2c_slave_state.position);
+            if (i2c_slave_state.position < i2c_slave_state.size2 && !i2c_slave_state.read_only2) {
+                if (i2c_slave_state.page_size2 > 0) {
+                    uint8_t page_mask = i2c_slave_state.page_size2 - 1;
+                    if (i2c_slave_state.write_buffer2 != NULL) {
+                        i2c_slave_state.write_buffer2[i2c_slave_state.position & page_mask] = value;
+                    } else {
+                        i2c_slave_state.registers2[i2c_slave_state.position] = value;
+                    }
+                    if (i2c_slave_state.write_count2 < i2c_slave_state.page_size2) {
+                        i2c_slave_state.write_count2++;
+                    }
+                    i2c_slave_state.position = (i2c_slave_state.position & ~page_mask) | ((i2c_slave_state.position + 1) & page_mask);
+                } else {
+                    i2c_slave_state.registers2[i2c_slave_state.position] = value;
+                    i2c_slave_state.position++;
                 }
-                i2c_slave_state.position++;
-            } else {
-                I2C1->DATAR = 0x00;
             }
         } else {
-            if (i2c_slave_state.position < i2c_slave_state.size1) {
-                I2C1->DATAR = i2c_slave_state.registers1[i2c_slave_state.position];
-                if (i2c_slave_state.read_callback1 != NULL) {
-                    i2c_slave_state.read_callback1(i2c_slave_state.position);
+            if (i2c_slave_state.position < i2c_slave_state.size1 && !i2c_slave_state.read_only1) {
+                SetI2CSlaveRegister(i2c_slave_state.position, value);
+                if (i2c_slave_state.dirty_first > i2c_slave_state.dirty_last) {
+                    i2c_slave_state.dirty_first = i2c_slave_state.position;
                 }
+                i2c_slave_state.dirty_last = i2c_slave_state.position;
                 i2c_slave_state.position++;
-            } else {
-                I2C1->DATAR = 0x00;
             }
         }
     }
+}
 
-    if (STAR1 & I2C_STAR1_STOPF) { // Stop event
-        I2C1->CTLR1 &= ~(I2C_CTLR1_STOP); // Clear stop
-        if (i2c_slave_state.address2matched) {
-            if (i2c_slave_state.write_callback2 != NULL) {
-                i2c_slave_state.write_callback2(i2c_slave_state.offset, i2c_slave_state.position - i2c_slave_state.offset);
+// End of a read of the primary address, at the stop, the not acknowledged last
+// byte or a repeated start, whichever the interrupt handlers see first
+static void I2CSlaveReadDone() {
+    if (!i2c_slave_state.reading) {
+        return;
+    }
+    i2c_slave_state.reading = false;
+    uint16_t offset = i2c_slave_state.offset;
+    if (i2c_slave_state.read_done_callback1 == NULL || i2c_slave_state.read_count < 2 || offset >= i2c_slave_state.size1) {
+        return;
+    }
+    uint16_t length = i2c_slave_state.read_count - 1;
+    if (length > i2c_slave_state.size1 - offset) {
+        length = i2c_slave_state.size1 - offset;
+    }
+    i2c_slave_state.read_done_callback1(offset, length);
+}
+
+// Load the next byte of a read
+static void I2CSlaveTransmit() {
+    i2c_slave_state.bytes++;
+    if (i2c_slave_state.address2matched) {
+        if (i2c_slave_state.position < i2c_slave_state.size2) {
+            I2C1->DATAR = *I2CSlaveSecondaryRegister(i2c_slave_state.position, NULL);
+            if (i2c_slave_state.read_callback2 != NULL) {
+                i2c_slave_state.read_callback2(i2c_slave_state.position);
+            }
+            i2c_slave_state.position++;
+            if (i2c_slave_state.page_size2 > 0 && i2c_slave_state.position >= i2c_slave_state.size2) {
+                i2c_slave_state.position = 0;
             }
         } else {
-            if (i2c_slave_state.write_callback1 != NULL) {
-                i2c_slave_state.write_callback1(i2c_slave_state.offset, i2c_slave_state.position - i2c_slave_state.offset);
+            I2C1->DATAR = 0x00;
+        }
+    } else {
+        i2c_slave_state.read_count++;
+        if (i2c_slave_state.position < i2c_slave_state.size1) {
+            I2C1->DATAR = *I2CSlaveReadRegister(i2c_slave_state.position, NULL);
+            if (i2c_slave_state.read_callback1 != NULL) {
+                i2c_slave_state.read_callback1(i2c_slave_state.position);
             }
+            i2c_slave_state.position++;
+        } else {
+            I2C1->DATAR = 0x00;
+        }
+    }
+}
+
+#ifdef I2C_SLAVE_USE_DMA
+// Interrupt per byte for the rest of the transaction
+static void I2CSlaveByteMode() {
+    I2C1->CTLR2 = (I2C1->CTLR2 & ~I2C_CTLR2_DMAEN) | I2C_CTLR2_ITBUFEN;
+    i2c_slave_state.dma = false;
+}
+
+// Handle the bytes the DMA has received so far and restart it
+static void I2CSlaveDmaReceive() {
+    DMA1_Channel7->CFGR &= ~DMA_CFGR1_EN;
+    uint16_t count = sizeof(i2c_slave_state.dma_buffer) - DMA1_Channel7->CNTR;
+    for (uint16_t i = 0; i < count; i++) {
+        I2CSlaveReceive(i2c_slave_state.dma_buffer[i]);
+    }
+    DMA1_Channel7->CNTR = sizeof(i2c_slave_state.dma_buffer);
+    DMA1_Channel7->CFGR |= DMA_CFGR1_EN;
+}
+
+// Account for the bytes the DMA has loaded for a read and stop it
+static void I2CSlaveDmaTransmitDone() {
+    DMA1_Channel6->CFGR &= ~DMA_CFGR1_EN;
+    uint16_t count = i2c_slave_state.dma_count - DMA1_Channel6->CNTR;
+    i2c_slave_state.position += count;
+    i2c_slave_state.bytes += count;
+    if (!i2c_slave_state.address2matched) {
+        i2c_slave_state.read_count += count;
+    }
+    i2c_slave_state.dma_count = 0;
+}
+
+// Select how the data phase of a transaction that has just been addressed is handled.
+// Reads of registers with a read callback are done byte by byte, the callback runs as
+// each byte is loaded. A read that starts before those registers uses DMA up to them.
+// A DMA transfer covers registers of one bank, at the end of a shadow range the next
+// transfer is started from the transmit DMA interrupt.
+static void I2CSlaveDmaStart(bool transmit) {
+    if (!transmit) {
+        I2C1->CTLR2 = (I2C1->CTLR2 & ~I2C_CTLR2_ITBUFEN) | I2C_CTLR2_DMAEN;
+        i2c_slave_state.dma = true;
+        return;
+    }
+
+    i2c_slave_state.writing = false;
+    uint16_t position = i2c_slave_state.position;
+    volatile uint8_t* source = NULL;
+    uint16_t end = 0; // The DMA transfer stops before this register
+    if (i2c_slave_state.address2matched) {
+        source = I2CSlaveSecondaryRegister(position, &end);
+        if (i2c_slave_state.read_callback2 != NULL) {
+            end = 0;
+        }
+    } else if (position < i2c_slave_state.size1) {
+        source = I2CSlaveReadRegister(position, &end);
+        if (i2c_slave_state.read_callback1 != NULL && position <= i2c_slave_state.read_last1 && i2c_slave_state.read_first1 < end) {
+            end = i2c_slave_state.read_first1;
         }
     }
+    if (position >= end) {
+        I2CSlaveByteMode();
+        return;
+    }
+
+    i2c_slave_state.dma_count = end - position;
+    DMA1_Channel6->MADDR = (uint32_t) source;
+    DMA1_Channel6->CNTR = i2c_slave_state.dma_count;
+    DMA1_Channel6->CFGR |= DMA_CFGR1_EN;
+    I2C1->CTLR2 = (I2C1->CTLR2 & ~I2C_CTLR2_ITBUFEN) | I2C_CTLR2_DMAEN;
+    i2c_slave_state.dma = true;
+}
+
+// Transmit DMA done, the read continues with the next run of registers or byte by byte
+void DMA1_Channel6_IRQHandler(void) __attribute__((interrupt));
+void DMA1_Channel6_IRQHandler(void) {
+    uint32_t isr_start = SysTick->CNT;
+    DMA1->INTFCR = DMA1_IT_GL6;
+    I2CSlaveDmaTransmitDone();
+    I2CSlaveDmaStart(true);
+    I2CSlaveIsrDone(isr_start);
+}
+
+// Receive buffer full
+void DMA1_Channel7_IRQHandler(void) __attribute__((interrupt));
+void DMA1_Channel7_IRQHandler(void) {
+    uint32_t isr_start = SysTick->CNT;
+    DMA1->INTFCR = DMA1_IT_GL7;
+    I2CSlaveDmaReceive();
+    I2CSlaveIsrDone(isr_start);
+}
+#endif
+
+void I2C1_EV_IRQHandler(void) __attribute__((interrupt));
+void I2C1_EV_IRQHandler(void) {
+    uint32_t isr_start = SysTick->CNT;
+    uint16_t STAR1, STAR2 __attribute__((unused));
+    STAR1 = I2C1->STAR1;
+    STAR2 = I2C1->STAR2;
+
+    if (STAR1 & I2C_STAR1_ADDR) { // Start event
+#ifdef I2C_SLAVE_USE_DMA
+        // Finish the previous transaction first in case of a repeated start
+        I2CSlaveDmaReceive();
+        if (i2c_slave_state.dma_count > 0) {
+            I2CSlaveDmaTransmitDone();
+        }
+#endif
+        I2CSlaveReadDone();
+        if (i2c_slave_state.writing && !i2c_slave_state.address2matched) {
+            I2CSlaveDispatch(); // Repeated start after a write
+        }
+        i2c_slave_state.address2matched = !!(STAR2 & I2C_STAR2_DUALF);
+        bool wide = i2c_slave_state.address2matched ? i2c_slave_state.wide2 : i2c_slave_state.wide1;
+        i2c_slave_state.first_write = wide ? 2 : 1; // Next writes will be the offset
+        i2c_slave_state.position = i2c_slave_state.offset; // Reset position
+        i2c_slave_state.read_shadow1 = i2c_slave_state.shadow_published1; // Latch the snapshot
+        i2c_slave_state.reading = (STAR2 & I2C_STAR2_TRA) && !i2c_slave_state.address2matched;
+        i2c_slave_state.read_count = 0;
+        i2c_slave_state.write_count2 = 0;
+#ifdef I2C_SLAVE_USE_DMA
+        I2CSlaveDmaStart(STAR2 & I2C_STAR2_TRA);
+#endif
+    }
+
+#ifdef I2C_SLAVE_USE_DMA
+    if (i2c_slave_state.dma) {
+        STAR1 &= ~(I2C_STAR1_RXNE | I2C_STAR1_TXE); // Handled by the DMA
+    }
+#endif
+
+    if (STAR1 & I2C_STAR1_RXNE) { // Write event
+        I2CSlaveReceive(I2C1->DATAR);
+    }
+
+    if (STAR1 & I2C_STAR1_TXE) { // Read event
+        i2c_slave_state.writing = false;
+        I2CSlaveTransmit();
+    }
+
+    if (STAR1 & I2C_STAR1_STOPF) { // Stop event
+        I2C1->CTLR1 &= ~(I2C_CTLR1_STOP); // Clear stop
+#ifdef I2C_SLAVE_USE_DMA
+        I2CSlaveDmaReceive();
+        if (i2c_slave_state.dma_count > 0) {
+            I2CSlaveDmaTransmitDone();
+        }
+#endif
+        I2CSlaveReadDone();
+        if (i2c_slave_state.writing) { // Reads do not trigger the write callback
+            if (i2c_slave_state.address2matched) {
+                if (i2c_slave_state.write_callback2 != NULL) {
+                    uint16_t length = i2c_slave_state.page_size2 > 0 ? i2c_slave_state.write_count2 : i2c_slave_state.position - i2c_slave_state.offset;
+                    i2c_slave_state.write_callback2(i2c_slave_state.offset, length);
+                }
+            } else {
+                I2CSlaveDispatch();
+                if (i2c_slave_state.write_callback1 != NULL) {
+                    i2c_slave_state.write_callback1(i2c_slave_state.offset, i2c_slave_state.position - i2c_slave_state.offset);
+                }
+            }
+            i2c_slave_state.writing = false;
+        }
+    }
+
+    I2CSlaveIsrDone(isr_start);
 }
 
 void I2C1_ER_IRQHandler(void) __attribute__((interrupt));
@@ -213,8 +768,14 @@ void I2C1_ER_IRQHandler(void) {
         I2C1->STAR1 &= ~(I2C_STAR1_ARLO); // Clear error
     }
 
-    if (STAR1 & I2C_STAR1_AF) { // Acknowledge failure
+    if (STAR1 & I2C_STAR1_AF) { // Acknowledge failure, the host ends a read this way
         I2C1->STAR1 &= ~(I2C_STAR1_AF); // Clear error
+#ifdef I2C_SLAVE_USE_DMA
+        if (i2c_slave_state.dma_count > 0) {
+            I2CSlaveDmaTransmitDone();
+        }
+#endif
+        I2CSlaveReadDone();
     }
 }
 
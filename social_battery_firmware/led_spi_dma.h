@@ -0,0 +1,172 @@
+/*
+ * Single-File-Header for driving WS2812/SK6812 addressable LEDs on PC6
+ * using SPI1 MOSI with DMA
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 Renze Nicolai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// LED data is encoded into 4-bit symbols by led_spi_encoder.h, one chunk at a
+// time into two halves of a small buffer which DMA1 channel 3 streams to the
+// SPI in circular mode. While one half is sent the interrupt handler encodes
+// the next chunk into the other half, see led_spi_encoder.h for the timing.
+//
+// Only MOSI (PC6) is used, the caller is responsible for configuring it as an
+// alternate function push-pull output. SCK (PC5) and MISO (PC7) stay regular GPIO.
+
+#ifndef __LED_SPI_DMA_H
+#define __LED_SPI_DMA_H
+
+#include "ch32v003fun.h"
+#include "led_spi_encoder.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#ifndef LED_SPI_MAX_BYTES
+#define LED_SPI_MAX_BYTES 15
+#endif
+
+#define LED_SPI_LATCH (80 * DELAY_US_TIME) // Minimum low time between frames (SysTick ticks)
+
+// SPI clock prescaler for a 3 MHz bit clock
+#if FUNCONF_SYSTEM_CORE_CLOCK == 48000000
+#define LED_SPI_PRESCALER (3 << 3) // Divide by 16
+#elif FUNCONF_SYSTEM_CORE_CLOCK == 24000000
+#define LED_SPI_PRESCALER (2 << 3) // Divide by 8
+#else
+#error "No SPI prescaler for a 3 MHz LED bit clock at this system clock"
+#endif
+
+typedef void (*led_spi_callback_t)(void);
+
+struct _led_spi_state {
+    uint8_t frame[LED_SPI_MAX_BYTES];
+    uint8_t buffer[LED_SPI_HALF_SIZE * 2];
+    uint8_t length;
+    uint8_t position;
+    bool half_idle[2];
+    volatile bool transmitting;
+    volatile uint32_t done_time;
+    led_spi_callback_t done_callback;
+    uint32_t isr_max_time; // Longest run of the interrupt handler (SysTick ticks)
+} led_spi_state;
+
+// Fill one half of the buffer with the next chunk of the frame, or with idle (low) bits after the end
+static void LedSpiFillHalf(uint8_t half) {
+    uint8_t* out = &led_spi_state.buffer[half * LED_SPI_HALF_SIZE];
+    led_spi_state.half_idle[half] = LedSpiEncodeChunk(led_spi_state.frame, led_spi_state.length, &led_spi_state.position, out);
+}
+
+void SetupLedSpi(led_spi_callback_t done_callback) {
+    led_spi_state.length = 0;
+    led_spi_state.transmitting = false;
+    led_spi_state.done_time = SysTick->CNT;
+    led_spi_state.done_callback = done_callback;
+    led_spi_state.isr_max_time = 0;
+
+    RCC->AHBPCENR |= RCC_AHBPeriph_DMA1;
+    RCC->APB2PCENR |= RCC_APB2Periph_SPI1;
+
+    // Transmit only master, MSB first, 8-bit frames
+    SPI1->CTLR1 = SPI_NSS_Soft | SPI_CPHA_1Edge | SPI_CPOL_Low | SPI_DataSize_8b | SPI_Mode_Master | SPI_Direction_1Line_Tx | LED_SPI_PRESCALER;
+    SPI1->CTLR2 = SPI_CTLR2_TXDMAEN;
+    SPI1->CTLR1 |= CTLR1_SPE_Set;
+
+    DMA1_Channel3->PADDR = (uint32_t) &SPI1->DATAR;
+    DMA1_Channel3->MADDR = (uint32_t) led_spi_state.buffer;
+    DMA1_Channel3->CFGR = DMA_M2M_Disable | DMA_Priority_VeryHigh | DMA_MemoryDataSize_Byte | DMA_PeripheralDataSize_Byte |
+                          DMA_MemoryInc_Enable | DMA_Mode_Circular | DMA_DIR_PeripheralDST | DMA_IT_TC | DMA_IT_HT;
+
+    NVIC_EnableIRQ(DMA1_Channel3_IRQn);
+    NVIC_SetPriority(DMA1_Channel3_IRQn, 3 << 4); // Below the I2C interrupts
+}
+
+// The frame sent last, or being sent
+const uint8_t* GetLedSpiFrame(uint8_t* length) {
+    *length = led_spi_state.length;
+    return led_spi_state.frame;
+}
+
+// Longest run of the interrupt handler since the last reset, in SysTick ticks
+uint32_t GetLedSpiIsrMaxTime() {
+    return led_spi_state.isr_max_time;
+}
+
+void ResetLedSpiIsrMaxTime() {
+    led_spi_state.isr_max_time = 0;
+}
+
+// True while a frame is being sent or the latch time after the previous frame has not passed yet
+bool LedSpiBusy() {
+    return led_spi_state.transmitting || ((SysTick->CNT - led_spi_state.done_time) < LED_SPI_LATCH);
+}
+
+// Start sending a frame. Waits for the previous frame to complete first,
+// the data can be modified as soon as this function returns.
+void StartLedSpiTransfer(const uint8_t* data, uint8_t length) {
+    while (LedSpiBusy());
+
+    if (length > LED_SPI_MAX_BYTES) {
+        length = LED_SPI_MAX_BYTES;
+    }
+
+    memcpy(led_spi_state.frame, data, length);
+    led_spi_state.length = length;
+    led_spi_state.position = 0;
+    LedSpiFillHalf(0);
+    LedSpiFillHalf(1);
+
+    led_spi_state.transmitting = true;
+    DMA1_Channel3->CFGR &= ~DMA_CFGR1_EN;
+    DMA1_Channel3->CNTR = sizeof(led_spi_state.buffer);
+    DMA1_Channel3->CFGR |= DMA_CFGR1_EN;
+}
+
+void DMA1_Channel3_IRQHandler(void) __attribute__((interrupt));
+void DMA1_Channel3_IRQHandler(void) {
+    uint32_t isr_start = SysTick->CNT;
+    uint32_t intfr = DMA1->INTFR;
+    DMA1->INTFCR = DMA1_IT_GL3;
+
+    // The half that has just been read by the DMA is free again
+    uint8_t half = (intfr & DMA1_IT_TC3) ? 1 : 0;
+
+    if (led_spi_state.half_idle[half]) {
+        // A complete idle chunk went out after the last data, the frame is done
+        DMA1_Channel3->CFGR &= ~DMA_CFGR1_EN;
+        led_spi_state.done_time = SysTick->CNT;
+        led_spi_state.transmitting = false;
+        if (led_spi_state.done_callback != NULL) {
+            led_spi_state.done_callback();
+        }
+    } else {
+        LedSpiFillHalf(half);
+    }
+
+    uint32_t duration = SysTick->CNT - isr_start;
+    if (duration > led_spi_state.isr_max_time) {
+        led_spi_state.isr_max_time = duration;
+    }
+}
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ * Single-File-Header with the SPI symbol encoder for WS2812/SK6812 addressable
+ * LEDs, used by led_spi_dma.h. Does not touch the hardware.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 Renze Nicolai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Every bit of LED data is sent as a 4-bit symbol on MOSI with the SPI clocked
+// at 3 MHz, giving a 1.33 us bit period:
+//
+//   0 -> 1000 (333 ns high, 1000 ns low)
+//   1 -> 1100 (667 ns high,  667 ns low)
+//
+// One LED byte becomes four SPI bytes, sent MSB first. A chunk of the frame is
+// encoded into a half buffer at a time, a half buffer after the end of the
+// frame is all zeros and keeps the line low for the latch.
+//
+// Sending one chunk takes LED_SPI_CHUNK_BYTES * 10.67 us. That is the time the
+// interrupt handler has to encode the next chunk after the DMA moved on to the
+// other half, so it bounds the latency of the LED interrupt: the I2C interrupts
+// run at a higher priority and the longest one (I2C_REG_LATENCY_ISR) must stay
+// well below it, 43 us with the default of 4 bytes. A flash erase stalls the CPU
+// for milliseconds, far longer than any chunk, so the firmware waits for the
+// LEDs to be idle before it writes to flash.
+
+#ifndef __LED_SPI_ENCODER_H
+#define __LED_SPI_ENCODER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#ifndef LED_SPI_CHUNK_BYTES
+#define LED_SPI_CHUNK_BYTES 4 // LED bytes encoded per half buffer
+#endif
+
+#define LED_SPI_HALF_SIZE (LED_SPI_CHUNK_BYTES * 4) // Two 4-bit symbols per SPI byte
+
+// Two LED bits per SPI byte, indexed by the bit pair
+static const uint8_t led_spi_symbols[4] = {0x88, 0x8C, 0xC8, 0xCC};
+
+// Encode length bytes of LED data into length * 4 bytes of SPI data
+static inline void LedSpiEncode(const uint8_t* data, uint8_t length, uint8_t* out) {
+    for (uint8_t pos_byte = 0; pos_byte < length; pos_byte++) {
+        uint8_t value = data[pos_byte];
+        *out++ = led_spi_symbols[(value >> 6) & 3];
+        *out++ = led_spi_symbols[(value >> 4) & 3];
+        *out++ = led_spi_symbols[(value >> 2) & 3];
+        *out++ = led_spi_symbols[(value     ) & 3];
+    }
+}
+
+// Encode the chunk of the frame starting at position into a half buffer of
+// LED_SPI_HALF_SIZE bytes and pad the rest with idle (low) bits. Advances
+// position, returns true when the half is idle because the frame has ended.
+static inline bool LedSpiEncodeChunk(const uint8_t* frame, uint8_t length, uint8_t* position, uint8_t* out) {
+    uint8_t remaining = length - *position;
+    uint8_t chunk = remaining > LED_SPI_CHUNK_BYTES ? LED_SPI_CHUNK_BYTES : remaining;
+
+    LedSpiEncode(&frame[*position], chunk, out);
+    memset(out + chunk * 4, 0, LED_SPI_HALF_SIZE - chunk * 4);
+    *position += chunk;
+    return chunk == 0;
+}
+
+#endif
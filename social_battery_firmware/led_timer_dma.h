@@ -0,0 +1,184 @@
+/*
+ * Single-File-Header for driving WS2812/SK6812 addressable LEDs on PC6
+ * using TIM1 PWM with DMA-loaded compare values
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 Renze Nicolai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Every bit of LED data is sent as one PWM period of TIM1 channel 1, which is
+// partially remapped (TIM1_RM = 01) onto PC6. On each update event DMA1 channel 5
+// loads the compare value for the next period from a small buffer in circular
+// mode. The compare values are encoded by led_timer_encoder.h, one chunk at a time
+// into two halves of the buffer: while one half is sent the interrupt handler
+// encodes the next chunk into the other half, see led_timer_encoder.h for the timing.
+//
+// The caller is responsible for configuring PC6 as an alternate function push-pull output.
+
+#ifndef __LED_TIMER_DMA_H
+#define __LED_TIMER_DMA_H
+
+#include "ch32v003fun.h"
+#include "led_timer_encoder.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#ifndef LED_TIMER_MAX_BYTES
+#define LED_TIMER_MAX_BYTES 15
+#endif
+
+#define LED_TIMER_LATCH (80 * DELAY_US_TIME) // Minimum low time between frames (SysTick ticks)
+
+#define LED_TIMER_TIM1_REMAP_MASK (3 << 6)
+#define LED_TIMER_TIM1_REMAP_PC6  (1 << 6) // TIM1_RM = 01: CH1 on PC6
+
+typedef void (*led_timer_callback_t)(void);
+
+struct _led_timer_state {
+    uint8_t frame[LED_TIMER_MAX_BYTES];
+    uint8_t buffer[LED_TIMER_HALF_SIZE * 2];
+    uint8_t length;
+    uint8_t position;
+    bool half_idle[2];
+    volatile bool transmitting;
+    volatile uint32_t done_time;
+    led_timer_callback_t done_callback;
+    uint32_t isr_max_time; // Longest run of the interrupt handler (SysTick ticks)
+} led_timer_state;
+
+// Fill one half of the buffer with the next chunk of the frame, or with idle periods after the end
+static void LedTimerFillHalf(uint8_t half) {
+    uint8_t* out = &led_timer_state.buffer[half * LED_TIMER_HALF_SIZE];
+    led_timer_state.half_idle[half] = LedTimerEncodeChunk(led_timer_state.frame, led_timer_state.length, &led_timer_state.position, out);
+}
+
+void SetupLedTimer(led_timer_callback_t done_callback) {
+    led_timer_state.length = 0;
+    led_timer_state.transmitting = false;
+    led_timer_state.done_time = SysTick->CNT;
+    led_timer_state.done_callback = done_callback;
+    led_timer_state.isr_max_time = 0;
+
+    RCC->AHBPCENR |= RCC_AHBPeriph_DMA1;
+    RCC->APB2PCENR |= RCC_APB2Periph_TIM1 | RCC_APB2Periph_AFIO;
+
+    // Route TIM1 channel 1 to PC6
+    AFIO->PCFR1 = (AFIO->PCFR1 & ~LED_TIMER_TIM1_REMAP_MASK) | LED_TIMER_TIM1_REMAP_PC6;
+
+    // Reset TIM1 to init all regs
+    RCC->APB2PRSTR |= RCC_APB2Periph_TIM1;
+    RCC->APB2PRSTR &= ~RCC_APB2Periph_TIM1;
+
+    TIM1->PSC = 0;
+    TIM1->ATRLR = LED_TIMER_PERIOD - 1;
+    TIM1->CHCTLR1 = TIM_OC1M_2 | TIM_OC1M_1 | TIM_OC1PE; // PWM mode 1 with preloaded compare value
+    TIM1->CH1CVR = 0; // Output stays low while idle
+    TIM1->CCER = TIM_CC1E;
+    TIM1->BDTR = TIM_MOE;
+    TIM1->CTLR1 = TIM_ARPE;
+    TIM1->SWEVGR = TIM_UG; // Load the shadow registers
+    TIM1->DMAINTENR = TIM_UDE; // Request a DMA transfer on every update event
+
+    DMA1_Channel5->PADDR = (uint32_t) &TIM1->CH1CVR;
+    DMA1_Channel5->MADDR = (uint32_t) led_timer_state.buffer;
+    DMA1_Channel5->CFGR = DMA_M2M_Disable | DMA_Priority_VeryHigh | DMA_MemoryDataSize_Byte | DMA_PeripheralDataSize_HalfWord |
+                          DMA_MemoryInc_Enable | DMA_Mode_Circular | DMA_DIR_PeripheralDST | DMA_IT_TC | DMA_IT_HT;
+
+    NVIC_EnableIRQ(DMA1_Channel5_IRQn);
+    NVIC_SetPriority(DMA1_Channel5_IRQn, 3 << 4); // Below the I2C interrupts
+}
+
+// The frame sent last, or being sent
+const uint8_t* GetLedTimerFrame(uint8_t* length) {
+    *length = led_timer_state.length;
+    return led_timer_state.frame;
+}
+
+// Longest run of the interrupt handler since the last reset, in SysTick ticks
+uint32_t GetLedTimerIsrMaxTime() {
+    return led_timer_state.isr_max_time;
+}
+
+void ResetLedTimerIsrMaxTime() {
+    led_timer_state.isr_max_time = 0;
+}
+
+// True while a frame is being sent or the latch time after the previous frame has not passed yet
+bool LedTimerBusy() {
+    return led_timer_state.transmitting || ((SysTick->CNT - led_timer_state.done_time) < LED_TIMER_LATCH);
+}
+
+// Start sending a frame. Waits for the previous frame to complete first, the data
+// is copied so it can be modified as soon as this function returns.
+void StartLedTimerTransfer(const uint8_t* data, uint8_t length) {
+    while (LedTimerBusy());
+
+    if (length > LED_TIMER_MAX_BYTES) {
+        length = LED_TIMER_MAX_BYTES;
+    }
+
+    memcpy(led_timer_state.frame, data, length);
+    led_timer_state.length = length;
+    led_timer_state.position = 0;
+    LedTimerFillHalf(0);
+    LedTimerFillHalf(1);
+
+    led_timer_state.transmitting = true;
+    DMA1_Channel5->CFGR &= ~DMA_CFGR1_EN;
+    DMA1_Channel5->CNTR = sizeof(led_timer_state.buffer);
+    DMA1_Channel5->CFGR |= DMA_CFGR1_EN;
+
+    // The first period is idle, its update event loads the first bit
+    TIM1->CNT = 0;
+    TIM1->CTLR1 |= TIM_CEN;
+}
+
+void DMA1_Channel5_IRQHandler(void) __attribute__((interrupt));
+void DMA1_Channel5_IRQHandler(void) {
+    uint32_t isr_start = SysTick->CNT;
+    uint32_t intfr = DMA1->INTFR;
+    DMA1->INTFCR = DMA1_IT_GL5;
+
+    // The half that has just been loaded by the DMA is free again
+    uint8_t half = (intfr & DMA1_IT_TC5) ? 1 : 0;
+
+    if (led_timer_state.half_idle[half]) {
+        // A complete idle chunk has been loaded after the last data, the last bit has been sent completely
+        TIM1->CTLR1 &= ~TIM_CEN;
+        DMA1_Channel5->CFGR &= ~DMA_CFGR1_EN;
+        led_timer_state.done_time = SysTick->CNT;
+        led_timer_state.transmitting = false;
+        if (led_timer_state.done_callback != NULL) {
+            led_timer_state.done_callback();
+        }
+    } else {
+        LedTimerFillHalf(half);
+    }
+
+    uint32_t duration = SysTick->CNT - isr_start;
+    if (duration > led_timer_state.isr_max_time) {
+        led_timer_state.isr_max_time = duration;
+    }
+}
+
+#endif
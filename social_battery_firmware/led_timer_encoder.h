@@ -0,0 +1,91 @@
+/*
+ * Single-File-Header with the PWM compare value encoder for WS2812/SK6812
+ * addressable LEDs, used by led_timer_dma.h. Does not touch the hardware.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 Renze Nicolai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Every bit of LED data is sent as one PWM period of 1.25 us, its compare value
+// sets the high time:
+//
+//   0 -> 300 ns high
+//   1 -> 600 ns high
+//
+// One LED byte becomes eight compare values, MSB first. A chunk of the frame is
+// encoded into a half buffer at a time, a half buffer after the end of the frame
+// is all zeros and keeps the line low for the latch.
+//
+// Sending one chunk takes LED_TIMER_CHUNK_BYTES * 10 us, the time the interrupt
+// handler has to encode the next chunk, 20 us with the default of 2 bytes. The
+// same rules as for the SPI backend apply, see led_spi_encoder.h: the longest I2C
+// interrupt (I2C_REG_LATENCY_ISR) must stay well below it. A larger chunk costs
+// 16 bytes of RAM per byte.
+
+#ifndef __LED_TIMER_ENCODER_H
+#define __LED_TIMER_ENCODER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#ifndef LED_TIMER_CHUNK_BYTES
+#define LED_TIMER_CHUNK_BYTES 2 // LED bytes encoded per half buffer
+#endif
+
+#define LED_TIMER_HALF_SIZE (LED_TIMER_CHUNK_BYTES * 8) // One compare value per bit
+
+#define LED_TIMER_NS_TO_TICKS(ns) (((FUNCONF_SYSTEM_CORE_CLOCK / 1000000) * (ns)) / 1000)
+#define LED_TIMER_PERIOD   LED_TIMER_NS_TO_TICKS(1250) // Bit period
+#define LED_TIMER_T0H      LED_TIMER_NS_TO_TICKS(300)  // High time of a 0 bit
+#define LED_TIMER_T1H      LED_TIMER_NS_TO_TICKS(600)  // High time of a 1 bit
+
+// Compare values are stored as bytes to save RAM, the DMA widens them to 16 bit
+#if LED_TIMER_PERIOD > 255
+#error "LED timer period does not fit in the 8-bit compare buffer"
+#endif
+
+// Encode length bytes of LED data into length * 8 compare values
+static inline void LedTimerEncode(const uint8_t* data, uint8_t length, uint8_t* out) {
+    for (uint8_t pos_byte = 0; pos_byte < length; pos_byte++) {
+        uint8_t value = data[pos_byte];
+        for (uint8_t i = 0; i < 8; i++) {
+            *out++ = (value & 0x80) ? LED_TIMER_T1H : LED_TIMER_T0H;
+            value <<= 1;
+        }
+    }
+}
+
+// Encode the chunk of the frame starting at position into a half buffer of
+// LED_TIMER_HALF_SIZE compare values and pad the rest with idle (low) periods.
+// Advances position, returns true when the half is idle because the frame has ended.
+static inline bool LedTimerEncodeChunk(const uint8_t* frame, uint8_t length, uint8_t* position, uint8_t* out) {
+    uint8_t remaining = length - *position;
+    uint8_t chunk = remaining > LED_TIMER_CHUNK_BYTES ? LED_TIMER_CHUNK_BYTES : remaining;
+
+    LedTimerEncode(&frame[*position], chunk, out);
+    memset(out + chunk * 8, 0, LED_TIMER_HALF_SIZE - chunk * 8);
+    *position += chunk;
+    return chunk == 0;
+}
+
+#endif
@@ -12,7 +12,24 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include "color_utilities.h"
+#include "scheduler.h"
+#include "touch.h"
+#include "event_queue.h"
+#include "slider.h"
+#include "touch_stats.h"
+#include "settings.h"
+#define EEPROM_INITIAL_DATA {'L','I','F','E',21,6,8,0,'W','I','C','C','O','N',' ','S','O','C','I','A','L',' ','B','A','T','T','E','R','Y','W','I','C','C','O','N',0x07,0x28,0,0,0,0,0,0}
+#include "eeprom.h"
+#include "animation.h"
+#include "effect_vm.h"
+#include "effects.h"
 #include "ch32v003_touch.h"
+#include "touch_scan.h"
+#ifdef LED_BACKEND_SPI
+#include "led_spi_dma.h"
+#else
+#include "led_timer_dma.h"
+#endif
 
 // Firmware version
 #define FW_VERSION 1
@@ -77,137 +94,710 @@
 #define I2C_REG_ADDR_LED4_GREEN   33
 #define I2C_REG_ADDR_LED4_RED     34
 #define I2C_REG_ADDR_LED4_BLUE    35
+#define I2C_REG_LATENCY_BOUND_0   36 // LSB, upper-bound estimate of the I2C response latency in microseconds, write to reset
+#define I2C_REG_LATENCY_BOUND_1   37 // MSB
+#define I2C_REG_LATENCY_ISR_0     38 // LSB, longest I2C event handler run time in microseconds
+#define I2C_REG_LATENCY_ISR_1     39 // MSB
+#define I2C_REG_LED_FRAMES_SENT_0 40 // LSB, number of LED frames sent
+#define I2C_REG_LED_FRAMES_SENT_1 41 // MSB
+#define I2C_REG_LED_FRAMES_SKIP_0 42 // LSB, number of unchanged LED frames that were not sent
+#define I2C_REG_LED_FRAMES_SKIP_1 43 // MSB
+#define I2C_REG_RENDER_PERIOD     44 // LED render period in milliseconds
+#define I2C_REG_TOUCH_PERIOD      45 // Touch scan period in milliseconds
+#define I2C_REG_TASK_STATS        46 // 46-105, read-only task statistics, see below
+#define I2C_REG_POWER_MODE        106
+#define I2C_REG_DUTY_CYCLE_0      107 // LSB, fraction of time the CPU is awake in 0.1%
+#define I2C_REG_DUTY_CYCLE_1      108 // MSB
+#define I2C_REG_LED_POWER         109 // LED power switch, see below
+#define I2C_REG_TOUCH_BASELINE    110 // 110-119, 16-bit touch baseline per channel, LSB first
+#define I2C_REG_TOUCH_FROZEN      120 // Bitmask of channels with a frozen baseline
+#define I2C_REG_TOUCH_PRESS       121 // 121-130, 16-bit press threshold per channel, LSB first
+#define I2C_REG_TOUCH_RELEASE     131 // 131-140, 16-bit release threshold per channel, LSB first
+#define I2C_REG_TOUCH_DEBOUNCE    141 // Number of scans a touch state change has to be stable
+#define I2C_REG_TOUCH_PRESSED     142 // Bitmask of pressed touch pads
+#define I2C_REG_EVENT_COUNT       143 // Number of queued input events, reading it fills the event window
+#define I2C_REG_EVENT_OVERFLOW    144 // Number of input events dropped because the queue was full, write to clear
+#define I2C_REG_EVENT_DATA        145 // 145-176, event window, see below
+#define I2C_REG_EVENT_IRQ         177 // Input event interrupt output, see below
+#define I2C_REG_SLIDER_POSITION   178 // Slider position 0-255 across the touch pads
+#define I2C_REG_SLIDER_CONTACT    179 // 1 while the slider is touched
+#define I2C_REG_SLIDER_VELOCITY_0 180 // LSB, signed slider velocity in position units per second
+#define I2C_REG_SLIDER_VELOCITY_1 181 // MSB
+#define I2C_REG_SLIDER_SWIPE_0    182 // LSB, speed of the last swipe in position units per second
+#define I2C_REG_SLIDER_SWIPE_1    183 // MSB
+#define I2C_REG_TOUCH_STATS       184 // 184-223, read-only touch signal quality statistics, see below
+#define I2C_REG_TOUCH_STATS_MODE  224 // Which touch scans are included in the statistics, see below
+#define I2C_REG_TOUCH_TAGGED_0    225 // LSB, number of touch scans that overlapped an LED transmission
+#define I2C_REG_TOUCH_TAGGED_1    226 // MSB
+#define I2C_REG_SETTINGS_WRITES_0 227 // LSB, number of settings records written to flash since boot
+#define I2C_REG_SETTINGS_WRITES_1 228 // MSB
+#define I2C_REG_SETTINGS_ERASES_0 229 // LSB, number of times the settings log has been compacted
+#define I2C_REG_SETTINGS_ERASES_1 230 // MSB
+#define I2C_REG_SETTINGS_LIFE_0   231 // LSB, erase cycles left before the settings flash reaches its rated endurance
+#define I2C_REG_SETTINGS_LIFE_1   232 // MSB
+#define I2C_REG_I2C_CONFIG        233 // I2C interface configuration, see below
+#define I2C_REG_I2C_LOAD_0        234 // LSB, average I2C interrupt time per transferred byte in cycles, reset with the latency
+#define I2C_REG_I2C_LOAD_1        235 // MSB
+#define I2C_REG_LED_COMMIT        236 // Write to show the frame in the LED registers in mode 0, see below
+#define I2C_REG_LED_RECEIVED_0    237 // LSB, number of LED frames committed
+#define I2C_REG_LED_RECEIVED_1    238 // MSB
+#define I2C_REG_LED_SHOWN_0       239 // LSB, number of committed LED frames sent to the LEDs
+#define I2C_REG_LED_SHOWN_1       240 // MSB
+#define I2C_REG_LED_DROPPED_0     241 // LSB, number of committed LED frames replaced by the next one before they were sent
+#define I2C_REG_LED_DROPPED_1     242 // MSB
+#define I2C_REG_ANIMATION_CONTROL 243 // Write ANIMATION_CONTROL_* to control the animation player
+#define I2C_REG_ANIMATION_STATUS  244 // ANIMATION_STATUS_* flags
+#define I2C_REG_ANIMATION_FRAME   245 // Index of the keyframe being played
+#define I2C_REG_EFFECT_VM_ERROR   246 // EFFECT_VM_ERROR_* of the last frame of the effect program
+#define I2C_REG_EFFECT_VM_STEPS_0 247 // LSB, instructions executed in the last frame of the effect program
+#define I2C_REG_EFFECT_VM_STEPS_1 248 // MSB
+#define I2C_REG_EFFECT_COUNT      249 // Number of effects
+#define I2C_REG_EFFECT_SELECT     250 // Index of the effect described by the next two registers
+#define I2C_REG_EFFECT_MODE       251 // System mode of the selected effect, 0xFF past the last one
+#define I2C_REG_EFFECT_FLAGS      252 // EFFECT_FLAG_* of the selected effect
+#define I2C_REG_TOUCH_SCAN_ISR_0  253 // LSB, time the last touch scan spent in its interrupt handler in microseconds
+#define I2C_REG_TOUCH_SCAN_ISR_1  254 // MSB
+#define I2C_NUM_REGISTERS         255
+
+// LED frame mailbox. In mode 0 the LEDs show the LED registers as they are at each render,
+// which can mix two frames when the host is writing. Writing any value to I2C_REG_LED_COMMIT
+// copies the LED registers into the mailbox instead, and the frame is sent right away. From
+// the first commit on only committed frames are shown, until the mode is written again.
+// received = shown + dropped + the frame waiting in the mailbox.
+
+// Animation player, plays the animation stored in the EEPROM from ANIMATION_EEPROM_OFFSET on
+// in EFFECT_MODE_ANIMATION. Hosts upload it with regular EEPROM writes, see animation.h for
+// the format. The animation restarts whenever it is written.
+#define ANIMATION_EEPROM_OFFSET   128
+#define ANIMATION_CONTROL_RESTART 1 // Start from the first keyframe
+#define ANIMATION_CONTROL_TRIGGER 2 // Trigger the animation as if an input event did
+#define ANIMATION_STATUS_VALID    0x01 // The EEPROM holds a valid animation
+#define ANIMATION_STATUS_WAITING  0x02 // Waiting for a trigger
+#define ANIMATION_STATUS_FINISHED 0x04 // Holding the last keyframe
+
+// Effect programs use the same part of the EEPROM as the animation and run in
+// EFFECT_MODE_PROGRAM, see effect_vm.h for the format. ANIMATION_CONTROL_RESTART and
+// writes to the program clear its variables.
+
+// I2C interface configuration
+#define I2C_CONFIG_WIDE_ADDRESSING 0x01 // 16-bit register offsets, MSB first, from the next transaction on
+
+// Task statistics, one block per task in task table order, all values LSB first
+#define I2C_TASK_STATS_RUN_COUNT  0 // 16-bit number of runs
+#define I2C_TASK_STATS_LAST       2 // 32-bit duration of the last run in cycles
+#define I2C_TASK_STATS_MAX        6 // 32-bit duration of the longest run in cycles
+#define I2C_TASK_STATS_SIZE       10
+#define I2C_TASK_STATS_MAX_TASKS  6
+
+// Touch statistics, one block per touch pad, all values LSB first
+#define I2C_TOUCH_STATS_MIN       0 // Signed 16-bit minimum delta of the last window
+#define I2C_TOUCH_STATS_MAX       2 // Signed 16-bit maximum delta of the last window
+#define I2C_TOUCH_STATS_VARIANCE  4 // 16-bit noise variance, saturates at 65535
+#define I2C_TOUCH_STATS_SNR       6 // 16-bit signal to noise ratio in units of 0.1
+#define I2C_TOUCH_STATS_SIZE      8
+
+// Touch statistics modes, scans during which a frame was sent to the LEDs are tagged
+#define TOUCH_STATS_ALL           0 // All scans
+#define TOUCH_STATS_LED_IDLE      1 // Only untagged scans
+#define TOUCH_STATS_LED_ACTIVE    2 // Only tagged scans
+
+// Event window, holds up to I2C_EVENT_WINDOW of the oldest queued events. A burst
+// read starting at I2C_REG_EVENT_COUNT returns the count followed by the events.
+// When the read ends every event the host has received completely is removed from
+// the queue, an event whose last byte was not acknowledged stays queued. Unused
+// slots read as zero (EVENT_NONE).
+//
+// Event format: byte 0 is the type (upper nibble) and source (lower nibble),
+// bytes 1-3 are a 24-bit timestamp in milliseconds, LSB first.
+#define I2C_EVENT_WINDOW          8
+
+// Event sources
+#define EVENT_SOURCE_TOUCH0       0 // 0-4, touch pads
+#define EVENT_SOURCE_BUTTON       5
+#define EVENT_SOURCE_SLIDER       6 // Tap, double tap and swipe events
+
+// Task periods
+#define DEFAULT_RENDER_PERIOD    20 // ms
+#define DEFAULT_TOUCH_PERIOD     20 // ms
+#define BUTTON_PERIOD             5 // ms
+#define REGISTERS_PERIOD         20 // ms
+#define SETTINGS_PERIOD        2000 // ms, settings are saved once they have not changed for a full period
+
+// Emulated EEPROM, behaves like a 24C02
+#define EEPROM_PAGE_SIZE          8 // Bytes, writes wrap around within a page
+#define EEPROM_WRITE_TIME         5 // ms, the EEPROM address is not acknowledged for this long after a write
+#define EEPROM_FLUSH_DELAY     1000 // ms, the EEPROM is written to flash once writes have stopped for this long
+#define BUTTON_DEBOUNCE_SAMPLES   3 // The button has to be stable for this many samples
+#define INPUT_LONG_PRESS        800 // ms, a touch pad or the button held this long generates a long press event
+
+// Settings stored in flash
+enum {
+    SETTING_SYSTEM_MODE,
+    SETTING_SOCIAL_LEVEL,
+    SETTING_RAINBOW_SPEED,
+    SETTING_KNIGHTRIDER_SPEED,
+    SETTING_BUTTON_ENABLED,
+    SETTING_TOUCH_DEBOUNCE,
+    SETTING_TOUCH_BASELINE, // One per touch pad
+    SETTING_TOUCH_PRESS     = SETTING_TOUCH_BASELINE + 5,
+    SETTING_TOUCH_RELEASE   = SETTING_TOUCH_PRESS + 5,
+    NUM_SETTINGS            = SETTING_TOUCH_RELEASE + 5,
+};
+
+_Static_assert(NUM_SETTINGS <= SETTINGS_KEYS, "Not enough room for the settings in the settings store");
+
+// A stored touch baseline is only updated when it is this far off, so slow drift does not wear out the flash
+#define SETTINGS_BASELINE_TOLERANCE 32
+
+// Unchanged LED frames are resent after this many renders, to recover from glitches on the LED chain
+#define LED_REFRESH_FRAMES 50
+
+// Power modes
+#define POWER_MODE_RUN   0 // Busy-wait between tasks
+#define POWER_MODE_SLEEP 1 // Sleep between tasks (default)
+
+// LED power switch, an optional external switch on one of the SAO IO lines
+#define LED_POWER_NONE        0x00
+#define LED_POWER_IO1         0x01
+#define LED_POWER_IO2         0x02
+#define LED_POWER_PIN_MASK    0x03
+#define LED_POWER_ACTIVE_LOW  0x04
+
+// Input event interrupt, an optional open-drain active-low output on one of the SAO IO lines that
+// is asserted while the event queue is not empty. The LED power switch has priority over it.
+#define EVENT_IRQ_NONE        0x00
+#define EVENT_IRQ_IO1         0x01
+#define EVENT_IRQ_IO2         0x02
+#define EVENT_IRQ_PIN_MASK    0x03
+
+// Badge off
+#define BUTTON_LONG_PRESS     2000 // ms, holding the button this long turns the badge off
+#define BADGE_OFF_AWU_WINDOW  16   // Touch scan interval in standby, in 16 ms auto wakeup ticks
+#define BADGE_OFF_RELEASE     20   // The button has to be released for this many milliseconds before standby
+
+// System modes, mode 0 shows the LED registers and the modes of the effects are in effects.h
+#define SYSTEM_MODE_LATENCY_BENCH 10 // LEDs animate back-to-back to load the latency bound registers, selectable over I2C only
+#define SYSTEM_MODE_OFF           11 // LEDs off and CPU in standby until touch, button or I2C activity
 
 // Variables
-volatile uint8_t i2c_registers[35] = {0};
+volatile uint8_t i2c_registers[I2C_NUM_REGISTERS] = {0};
+
+// Registers written by task_registers(), they are double buffered so a read returns
+// values from a single run. The LED, event and effect registers in between are not.
+const i2c_shadow_range_t i2c_shadow_ranges[] = {
+    {I2C_REG_FW_VERSION_0,     I2C_REG_BUTTON_ENABLED},
+    {I2C_REG_LATENCY_BOUND_0,  I2C_REG_TOUCH_PRESSED},
+    {I2C_REG_EVENT_IRQ,        I2C_REG_EFFECT_VM_STEPS_1},
+    {I2C_REG_TOUCH_SCAN_ISR_0, I2C_REG_TOUCH_SCAN_ISR_1},
+};
+
+#define I2C_SHADOW_SIZE ((I2C_REG_BUTTON_ENABLED - I2C_REG_FW_VERSION_0 + 1) + \
+                         (I2C_REG_TOUCH_PRESSED - I2C_REG_LATENCY_BOUND_0 + 1) + \
+                         (I2C_REG_EFFECT_VM_STEPS_1 - I2C_REG_EVENT_IRQ + 1) + \
+                         (I2C_REG_TOUCH_SCAN_ISR_1 - I2C_REG_TOUCH_SCAN_ISR_0 + 1))
+
+volatile uint8_t i2c_shadow_registers[I2C_SHADOW_SIZE]; // Second bank of the ranges above
 volatile uint8_t led_effect_data[15] = {0};
-const uint8_t eeprom_registers[] = {'L','I','F','E',21,6,8,0,'W','I','C','C','O','N',' ','S','O','C','I','A','L',' ','B','A','T','T','E','R','Y','W','I','C','C','O','N',0x07,0x28,0,0,0,0,0,0};
 
-uint32_t poll_interval_inputs = 20 * DELAY_MS_TIME;
-uint32_t input_poll_previous = 0;
+int32_t touch_value[5] = {0};
+uint32_t touch_press_time[5] = {0};
+uint8_t touch_long_event = 0; // Bitmask of pads for which the long press event has been queued
+volatile bool touch_scan_tagged = false; // The running touch scan overlaps an LED transmission
+uint8_t touch_stats_mode = TOUCH_STATS_ALL;
+uint16_t touch_tagged_scans = 0;
+volatile bool touch_stats_reset = false;
+
+// Event type for every slider gesture
+const uint8_t slider_gesture_events[] = {
+    [SLIDER_GESTURE_NONE]        = EVENT_NONE,
+    [SLIDER_GESTURE_TAP]         = EVENT_TAP,
+    [SLIDER_GESTURE_DOUBLE_TAP]  = EVENT_DOUBLE_TAP,
+    [SLIDER_GESTURE_SWIPE_LEFT]  = EVENT_SWIPE_LEFT,
+    [SLIDER_GESTURE_SWIPE_RIGHT] = EVENT_SWIPE_RIGHT,
+};
+
+bool button = false;
+bool prev_button = false;
+bool button_raw = false;
+uint8_t button_samples = 0;
+bool button_long = false;
+bool button_long_event = false;
+uint32_t button_press_time = 0;
+uint8_t button_press_mode = 0;
+
+bool i2c_enabled = false;
+uint8_t led_power_config = LED_POWER_NONE;
+uint8_t event_irq_config = EVENT_IRQ_NONE;
+uint8_t badge_off_return_mode = 0;
+volatile bool exti_wakeup = false;
 
 uint8_t social_level = 0; //0-4
 uint8_t system_mode = 0;
 bool button_enabled = false;
-uint8_t rainbow_speed = 15;
-uint8_t knightrider_speed = 0xFF - 10;
-uint8_t knightrider_led = 0;
-uint16_t knightrider_value = 0;
-bool knightrider_direction = false;
+uint8_t power_mode = POWER_MODE_SLEEP;
+
+uint8_t led_mailbox[15] = {0};           // Last committed frame, written from the I2C interrupt
+volatile bool led_mailbox_active = false; // Mode 0 shows committed frames only
+volatile bool led_mailbox_pending = false;
+uint16_t led_mailbox_received = 0;
+uint16_t led_mailbox_shown = 0;
+uint16_t led_mailbox_dropped = 0;
+volatile bool led_frame_dirty = true; // Forces the next frame to be sent
+uint8_t led_frames_unchanged = 0;
+uint16_t led_frames_sent = 0;
+uint16_t led_frames_skipped = 0;
+
+uint32_t eeprom_write_time = 0;
+volatile uint8_t eeprom_write_buffer[EEPROM_PAGE_SIZE]; // Last write by the host, see finish_eeprom_write()
+uint16_t eeprom_write_offset = 0;
+volatile uint8_t eeprom_write_length = 0;
+bool eeprom_animation_written = false; // The animation in the EEPROM changed and is not in flash yet
+
+const effect_t* effect_current = NULL;
+volatile bool effect_restart = true; // Run the init of the current effect at the next render
+
+uint8_t event_window_length = 0; // Number of events copied into the event window
+uint8_t event_window_next = 0;   // Window slot that is removed from the queue once it has been received
+
+// Tasks, each runs at its own period
+void task_touch();
+void task_button();
+void task_registers();
+void task_render();
+void task_settings();
+void task_eeprom();
+
+enum {
+    TASK_TOUCH,
+    TASK_BUTTON,
+    TASK_REGISTERS,
+    TASK_RENDER,
+    TASK_SETTINGS,
+    TASK_EEPROM,
+    NUM_TASKS,
+};
+
+scheduler_task_t tasks[NUM_TASKS] = {
+    [TASK_TOUCH]     = {.function = task_touch,     .period = DEFAULT_TOUCH_PERIOD  * DELAY_MS_TIME},
+    [TASK_BUTTON]    = {.function = task_button,    .period = BUTTON_PERIOD         * DELAY_MS_TIME},
+    [TASK_REGISTERS] = {.function = task_registers, .period = REGISTERS_PERIOD      * DELAY_MS_TIME},
+    [TASK_RENDER]    = {.function = task_render,    .period = DEFAULT_RENDER_PERIOD * DELAY_MS_TIME},
+    [TASK_SETTINGS]  = {.function = task_settings,  .period = SETTINGS_PERIOD       * DELAY_MS_TIME},
+    [TASK_EEPROM]    = {.function = task_eeprom,    .period = EEPROM_FLUSH_DELAY    * DELAY_MS_TIME},
+};
+
+_Static_assert(NUM_TASKS <= I2C_TASK_STATS_MAX_TASKS, "Not enough room for the task statistics in the register map");
 
 // Hardware control functions
 bool get_mode() {
     return !funDigitalRead(PIN_MODE);
 }
 
+const touch_scan_channel_t touch_channels[5] = {
+    {GPIOD, 6, 6}, // 1
+    {GPIOA, 1, 1}, // 2
+    {GPIOA, 2, 0}, // 3
+    {GPIOD, 5, 5}, // 4
+    {GPIOD, 4, 7}, // 5
+};
+
+// Blocking scan, the touch task reads the pads in the background instead
 void read_touch(uint32_t* value) {
-    int iterations = 10;
-    value[0] = ReadTouchPin(GPIOD, 6, 6, iterations); // 1
-    value[1] = ReadTouchPin(GPIOA, 1, 1, iterations); // 2
-    value[2] = ReadTouchPin(GPIOA, 2, 0, iterations); // 3
-    value[3] = ReadTouchPin(GPIOD, 5, 5, iterations); // 4
-    value[4] = ReadTouchPin(GPIOD, 4, 7, iterations); // 5
+    ReadTouchScan(value);
 }
 
-void knightrider_step(uint8_t color) {
-    for (uint8_t i = 0; i < 15; i++) {
-        if (led_effect_data[i] > 10) {
-            led_effect_data[i]-= 10;
-        } else {
-            led_effect_data[i] = 0;
-        }
+// Addressable LEDs
+void setup_addressable_leds() {
+#ifdef LED_BACKEND_SPI
+    SetupLedSpi(NULL);
+#else
+    SetupLedTimer(NULL);
+#endif
+}
+
+// The backend keeps a copy of the frame it sent last
+const uint8_t* addressable_leds_frame(uint8_t* length) {
+#ifdef LED_BACKEND_SPI
+    return GetLedSpiFrame(length);
+#else
+    return GetLedTimerFrame(length);
+#endif
+}
+
+bool addressable_leds_busy() {
+#ifdef LED_BACKEND_SPI
+    return LedSpiBusy();
+#else
+    return LedTimerBusy();
+#endif
+}
+
+// Longest run of the backend's interrupt handler, in SysTick ticks
+uint32_t addressable_leds_isr_max_time() {
+#ifdef LED_BACKEND_SPI
+    return GetLedSpiIsrMaxTime();
+#else
+    return GetLedTimerIsrMaxTime();
+#endif
+}
+
+void reset_addressable_leds_isr_max_time() {
+#ifdef LED_BACKEND_SPI
+    ResetLedSpiIsrMaxTime();
+#else
+    ResetLedTimerIsrMaxTime();
+#endif
+}
+
+// A flash erase or write stalls the CPU for longer than the LED backends can go
+// without refilling their buffer, flash is only written while the LEDs are idle
+void wait_addressable_leds() {
+    while (addressable_leds_busy());
+}
+
+void write_addressable_leds(uint8_t* data, uint8_t length) {
+    if (TouchScanBusy()) {
+        touch_scan_tagged = true;
     }
+    // Returns as soon as the frame has been queued, the peripheral and DMA send it in the background
+#ifdef LED_BACKEND_SPI
+    StartLedSpiTransfer(data, length);
+#else
+    StartLedTimerTransfer(data, length);
+#endif
+}
 
-    if (knightrider_value > (0xFF - knightrider_speed)) {
-        knightrider_value = 0;
-        if (!knightrider_direction) {
-            knightrider_led++;
-            if (knightrider_led >= 4) {
-                knightrider_direction = true;
-            }
-        } else {
-            knightrider_led--;
-            if (knightrider_led == 0) {
-                knightrider_direction = false;
-            }
-        }
-    } else {
-        knightrider_value++;
+// Only sends a frame when it differs from the last frame sent, when it has been
+// marked dirty or when a periodic refresh is due
+void update_addressable_leds(uint8_t* data, uint8_t length) {
+    uint8_t last_length;
+    const uint8_t* last = addressable_leds_frame(&last_length);
+    if (!led_frame_dirty && led_frames_unchanged < LED_REFRESH_FRAMES && length == last_length && memcmp(data, last, length) == 0) {
+        led_frames_unchanged++;
+        led_frames_skipped++;
+        return;
     }
+    led_frame_dirty = false;
+    led_frames_unchanged = 0;
+    led_frames_sent++;
+    write_addressable_leds(data, length);
+}
 
-    if (led_effect_data[(knightrider_led * 3) + color] < 215) {
-        led_effect_data[(knightrider_led * 3) + color] += 50;
-    } else {
-        led_effect_data[(knightrider_led * 3) + color] = 255;
+// Sends frames back-to-back so that LED output is active for as much of the time as possible
+void latency_bench_step() {
+    static uint8_t bench_hue = 0;
+    if (addressable_leds_busy()) {
+        return;
+    }
+    for (uint8_t led = 0; led < 5; led++) {
+        uint32_t color = EHSVtoHEX(bench_hue + (led * 50), 240, 128);
+        led_effect_data[(led * 3) + 0] = (color >>  8) & 0xFF;
+        led_effect_data[(led * 3) + 1] = (color >> 16) & 0xFF;
+        led_effect_data[(led * 3) + 2] = (color >>  0) & 0xFF;
     }
+    bench_hue++;
+    write_addressable_leds((uint8_t*) led_effect_data, 15);
 }
 
-// Addressable LEDs
-void write_addressable_leds(uint8_t* data, uint8_t length) __attribute__((optimize("O0")));
-void write_addressable_leds(uint8_t* data, uint8_t length) {
-    I2C1->CTLR2 &= ~(I2C_CTLR2_ITEVTEN); // Disable I2C event interrupt
-    for (uint8_t pos_byte = 0; pos_byte < length; pos_byte++) {
-        for (int i = 7; i >= 0; i--) {
-            if ((data[pos_byte] >> i) & 1) {
-                // Send 1
-                __asm__("nop");__asm__("nop");
-                GPIOC->BSHR |= 1 << (6);
-                __asm__("nop");__asm__("nop");__asm__("nop");__asm__("nop");
-                __asm__("nop");__asm__("nop");__asm__("nop");__asm__("nop");
-                __asm__("nop");__asm__("nop");__asm__("nop");__asm__("nop");
-                __asm__("nop");__asm__("nop");__asm__("nop");__asm__("nop");
-                __asm__("nop");__asm__("nop");__asm__("nop");__asm__("nop");
-                __asm__("nop");__asm__("nop");__asm__("nop");__asm__("nop");
-                __asm__("nop");__asm__("nop");__asm__("nop");__asm__("nop");
-                __asm__("nop");__asm__("nop");__asm__("nop");__asm__("nop");
-                __asm__("nop");__asm__("nop");
-                __asm__("nop");__asm__("nop");
-                GPIOC->BSHR |= 1 << (6 + 16);
-            } else {
-                // Send 0
-                GPIOC->BSHR |= 1 << (6);
-                __asm__("nop");__asm__("nop");__asm__("nop");__asm__("nop");
-                __asm__("nop");__asm__("nop");__asm__("nop");__asm__("nop");
-                __asm__("nop");__asm__("nop");__asm__("nop");__asm__("nop");
-                __asm__("nop");__asm__("nop");
-                GPIOC->BSHR |= 1 << (6 + 16);
-                __asm__("nop");__asm__("nop");__asm__("nop");__asm__("nop");
-                __asm__("nop");__asm__("nop");__asm__("nop");__asm__("nop");
-                __asm__("nop");__asm__("nop");__asm__("nop");__asm__("nop");
-                __asm__("nop");__asm__("nop");__asm__("nop");__asm__("nop");
-                __asm__("nop");__asm__("nop");__asm__("nop");__asm__("nop");
-            }
+// LED power switch
+uint8_t led_power_pin() {
+    return (led_power_config & LED_POWER_PIN_MASK) == LED_POWER_IO1 ? PIN_IO1 : PIN_IO2;
+}
+
+bool led_power_uses(uint8_t select) {
+    return (led_power_config & LED_POWER_PIN_MASK) == select;
+}
+
+void set_led_power(bool on) {
+    if (led_power_uses(LED_POWER_NONE)) {
+        return;
+    }
+    bool active_low = led_power_config & LED_POWER_ACTIVE_LOW;
+    funPinMode(led_power_pin(), GPIO_CFGLR_OUT_10Mhz_PP);
+    funDigitalWrite(led_power_pin(), on != active_low);
+}
+
+// Input event interrupt
+bool event_irq_uses(uint8_t select) {
+    return select != EVENT_IRQ_NONE && (event_irq_config & EVENT_IRQ_PIN_MASK) == select && !led_power_uses(select);
+}
+
+void update_event_irq() {
+    bool pending = GetEventCount() > 0;
+    if (event_irq_uses(EVENT_IRQ_IO1)) {
+        funDigitalWrite(PIN_IO1, !pending);
+    } else if (event_irq_uses(EVENT_IRQ_IO2)) {
+        funDigitalWrite(PIN_IO2, !pending);
+    }
+}
+
+void setup_event_irq() {
+    if (event_irq_uses(EVENT_IRQ_IO1)) {
+        funPinMode(PIN_IO1, GPIO_CFGLR_OUT_10Mhz_OD);
+    } else if (event_irq_uses(EVENT_IRQ_IO2)) {
+        funPinMode(PIN_IO2, GPIO_CFGLR_OUT_10Mhz_OD);
+    }
+    update_event_irq();
+}
+
+// SAO IO lines that are not used for the LED power switch or the event interrupt are available as GPIO
+bool io_line_free(uint8_t select) {
+    return !led_power_uses(select) && !event_irq_uses(select);
+}
+
+// Input events
+
+// The event registers are only updated with the I2C interrupt masked or from the I2C interrupt itself,
+// so the count register always matches the queue
+void update_event_registers() {
+    SetI2CSlaveRegister(I2C_REG_EVENT_COUNT, GetEventCount());
+    SetI2CSlaveRegister(I2C_REG_EVENT_OVERFLOW, GetEventOverflow());
+    update_event_irq();
+}
+
+void queue_input_event(uint8_t type, uint8_t source) {
+    I2CSlaveLock();
+    PushEvent(type, source, GetSchedulerMillis());
+    update_event_registers();
+    I2CSlaveUnlock();
+
+    // Touch pads and the button trigger the animation when pressed, the slider with any gesture
+    if (type == EVENT_PRESS || source == EVENT_SOURCE_SLIDER) {
+        AnimationEvent(source, GetSchedulerMillis());
+    }
+}
+
+// Called from the I2C interrupt when the count register is read
+void fill_event_window() {
+    uint8_t count = GetEventCount();
+    event_window_length = count < I2C_EVENT_WINDOW ? count : I2C_EVENT_WINDOW;
+    event_window_next = 0;
+    for (uint8_t i = 0; i < I2C_EVENT_WINDOW; i++) {
+        for (uint8_t j = 0; j < EVENT_SIZE; j++) {
+            SetI2CSlaveRegister(I2C_REG_EVENT_DATA + i * EVENT_SIZE + j, i < event_window_length ? PeekEvent(i)->data[j] : 0);
         }
     }
-    I2C1->CTLR2 |= I2C_CTLR2_ITEVTEN; // Enable I2C event interrupt
 }
 
 // Functions: I2C
 
-void onRead(uint8_t reg) {
-    // Empty
+void onRead(uint16_t reg) {
+    if (reg == I2C_REG_EVENT_COUNT) {
+        fill_event_window();
+    }
+}
+
+// Called from the I2C interrupt at the end of a read with the registers the host
+// has received, removes the events of the window it has read completely
+void onReadDone(uint16_t reg, uint16_t length) {
+    bool popped = false;
+    while (event_window_next < event_window_length) {
+        uint16_t first = I2C_REG_EVENT_DATA + event_window_next * EVENT_SIZE;
+        if (reg > first || reg + length < first + EVENT_SIZE) {
+            break;
+        }
+        PopEvent();
+        event_window_next++;
+        popped = true;
+    }
+    if (popped) {
+        update_event_registers();
+    }
 }
 
-void onWrite(uint8_t reg, uint8_t length) {
-    // GPIO mode
-    funPinMode(PIN_IO1, i2c_registers[I2C_REG_GPIO_MODE] & (1 << 0) ? GPIO_CFGLR_OUT_10Mhz_PP : GPIO_CFGLR_IN_PUPD);
-    funPinMode(PIN_IO2, i2c_registers[I2C_REG_GPIO_MODE] & (1 << 1) ? GPIO_CFGLR_OUT_10Mhz_PP : GPIO_CFGLR_IN_PUPD);
+// I2C register write handlers, each one is only called when one of its registers was written.
+// They run in the I2C interrupt handler at the end of the write transaction.
+
+void apply_gpio_mode() {
+    if (io_line_free(LED_POWER_IO1)) {
+        funPinMode(PIN_IO1, i2c_registers[I2C_REG_GPIO_MODE] & (1 << 0) ? GPIO_CFGLR_OUT_10Mhz_PP : GPIO_CFGLR_IN_PUPD);
+    }
+    if (io_line_free(LED_POWER_IO2)) {
+        funPinMode(PIN_IO2, i2c_registers[I2C_REG_GPIO_MODE] & (1 << 1) ? GPIO_CFGLR_OUT_10Mhz_PP : GPIO_CFGLR_IN_PUPD);
+    }
     funPinMode(PIN_E1, i2c_registers[I2C_REG_GPIO_MODE] & (1 << 2) ? GPIO_CFGLR_OUT_10Mhz_PP : GPIO_CFGLR_IN_PUPD);
     funPinMode(PIN_E2, i2c_registers[I2C_REG_GPIO_MODE] & (1 << 3) ? GPIO_CFGLR_OUT_10Mhz_PP : GPIO_CFGLR_IN_PUPD);
+}
 
-    // GPIO output
-    funDigitalWrite(PIN_IO1, i2c_registers[I2C_REG_GPIO_OUTPUTS] & (1 << 0));
-    funDigitalWrite(PIN_IO2, i2c_registers[I2C_REG_GPIO_OUTPUTS] & (1 << 1));
+void apply_gpio_outputs() {
+    if (io_line_free(LED_POWER_IO1)) {
+        funDigitalWrite(PIN_IO1, i2c_registers[I2C_REG_GPIO_OUTPUTS] & (1 << 0));
+    }
+    if (io_line_free(LED_POWER_IO2)) {
+        funDigitalWrite(PIN_IO2, i2c_registers[I2C_REG_GPIO_OUTPUTS] & (1 << 1));
+    }
     funDigitalWrite(PIN_E1, i2c_registers[I2C_REG_GPIO_OUTPUTS] & (1 << 2));
     funDigitalWrite(PIN_E2, i2c_registers[I2C_REG_GPIO_OUTPUTS] & (1 << 3));
+}
+
+void onWriteGpio(uint16_t reg, uint16_t length) {
+    apply_gpio_mode();
+    apply_gpio_outputs();
+}
+
+// The LED power switch and the input event interrupt take IO lines away from the GPIO
+// registers, a line that is released goes back to its GPIO configuration
+void onWriteIoLines(uint16_t reg, uint16_t length) {
+    if (reg <= I2C_REG_LED_POWER && reg + length > I2C_REG_LED_POWER) {
+        led_power_config = i2c_registers[I2C_REG_LED_POWER];
+        set_led_power(true);
+    }
+    if (reg <= I2C_REG_EVENT_IRQ && reg + length > I2C_REG_EVENT_IRQ) {
+        event_irq_config = i2c_registers[I2C_REG_EVENT_IRQ];
+    }
+    apply_gpio_mode();
+    apply_gpio_outputs();
+    setup_event_irq();
+}
 
-    // Control registers
+// Changes to the mode or to the LED registers force the next frame to be sent
+void onWriteMode(uint16_t reg, uint16_t length) {
     system_mode = i2c_registers[I2C_REG_MODE];
+    led_frame_dirty = true;
+    led_mailbox_active = false;
+    effect_restart = true;
+}
+
+void onWriteLeds(uint16_t reg, uint16_t length) {
+    led_frame_dirty = true;
+}
+
+// The LED registers are the back buffer of the mailbox, a commit swaps them in and the
+// render task is run right away
+void onWriteLedCommit(uint16_t reg, uint16_t length) {
+    for (uint8_t i = 0; i < 15; i++) {
+        led_mailbox[i] = i2c_registers[I2C_REG_ADDR_LED0_GREEN + i];
+    }
+    if (led_mailbox_pending) {
+        led_mailbox_dropped++;
+    }
+    led_mailbox_pending = true;
+    led_mailbox_active = true;
+    led_mailbox_received++;
+    if (system_mode == 0) {
+        RunSchedulerTaskNow(TASK_RENDER);
+    }
+}
+
+void onWriteAnimationControl(uint16_t reg, uint16_t length) {
+    uint8_t command = i2c_registers[I2C_REG_ANIMATION_CONTROL];
+    if (command == ANIMATION_CONTROL_RESTART) {
+        effect_restart = true;
+    } else if (command == ANIMATION_CONTROL_TRIGGER) {
+        effect_animation_state.trigger = true;
+    }
+}
+
+// Describe the effect selected with I2C_REG_EFFECT_SELECT, so hosts can list the effects
+void update_effect_registers() {
+    uint8_t index = i2c_registers[I2C_REG_EFFECT_SELECT];
+    SetI2CSlaveRegister(I2C_REG_EFFECT_COUNT, NUM_EFFECTS);
+    SetI2CSlaveRegister(I2C_REG_EFFECT_MODE, index < NUM_EFFECTS ? effects[index].mode : 0xFF);
+    SetI2CSlaveRegister(I2C_REG_EFFECT_FLAGS, index < NUM_EFFECTS ? effects[index].flags : 0);
+}
+
+void onWriteEffectSelect(uint16_t reg, uint16_t length) {
+    update_effect_registers();
+}
+
+void onWriteControl(uint16_t reg, uint16_t length) {
     social_level = i2c_registers[I2C_REG_SOCIAL_LEVEL];
-    rainbow_speed = i2c_registers[I2C_REG_RAINBOW_SPEED];
-    knightrider_speed = i2c_registers[I2C_REG_KNIGHTRIDER_SPEED];
+    effect_rainbow_state.speed = i2c_registers[I2C_REG_RAINBOW_SPEED];
+    effect_knightrider_state.speed = i2c_registers[I2C_REG_KNIGHTRIDER_SPEED];
     button_enabled = i2c_registers[I2C_REG_BUTTON_ENABLED];
+}
+
+void onWriteLatency(uint16_t reg, uint16_t length) {
+    ResetI2CSlaveLatency();
+    reset_addressable_leds_isr_max_time();
+    ResetTouchScanIsrMaxTime();
+}
+
+void onWritePeriods(uint16_t reg, uint16_t length) {
+    uint8_t render_period = i2c_registers[I2C_REG_RENDER_PERIOD];
+    uint8_t touch_period = i2c_registers[I2C_REG_TOUCH_PERIOD];
+    SetSchedulerPeriod(TASK_RENDER, (render_period > 0 ? render_period : 1) * DELAY_MS_TIME);
+    SetSchedulerPeriod(TASK_TOUCH, (touch_period > 0 ? touch_period : 1) * DELAY_MS_TIME);
+}
+
+void onWritePowerMode(uint16_t reg, uint16_t length) {
+    power_mode = i2c_registers[I2C_REG_POWER_MODE];
+}
+
+void onWriteTouchThresholds(uint16_t reg, uint16_t length) {
+    for (uint8_t i = 0; i < 5; i++) {
+        uint16_t press = i2c_registers[I2C_REG_TOUCH_PRESS + i * 2] | (i2c_registers[I2C_REG_TOUCH_PRESS + i * 2 + 1] << 8);
+        uint16_t release = i2c_registers[I2C_REG_TOUCH_RELEASE + i * 2] | (i2c_registers[I2C_REG_TOUCH_RELEASE + i * 2 + 1] << 8);
+        SetTouchThresholds(i, press, release);
+    }
+    SetTouchDebounce(i2c_registers[I2C_REG_TOUCH_DEBOUNCE]);
+}
+
+// Writing the overflow register clears it. Other writes to the event registers are
+// discarded and the window is invalid until the count is read again.
+void onWriteEvents(uint16_t reg, uint16_t length) {
+    if (reg <= I2C_REG_EVENT_OVERFLOW && reg + length > I2C_REG_EVENT_OVERFLOW) {
+        ClearEventOverflow();
+    }
+    update_event_registers();
+    event_window_length = 0;
+}
+
+// Changing the touch statistics mode restarts them
+void onWriteTouchStatsMode(uint16_t reg, uint16_t length) {
+    touch_stats_mode = i2c_registers[I2C_REG_TOUCH_STATS_MODE];
+    touch_stats_reset = true;
+}
+
+void onWriteI2CConfig(uint16_t reg, uint16_t length) {
+    SetI2CSlaveWideAddressing(i2c_registers[I2C_REG_I2C_CONFIG] & I2C_CONFIG_WIDE_ADDRESSING);
+}
+
+const i2c_write_handler_t i2c_write_handlers[] = {
+    {I2C_REG_GPIO_MODE,         I2C_REG_GPIO_OUTPUTS,                               onWriteGpio},
+    {I2C_REG_MODE,              I2C_REG_MODE,                                       onWriteMode},
+    {I2C_REG_SOCIAL_LEVEL,      I2C_REG_BUTTON_ENABLED,                             onWriteControl},
+    {I2C_REG_ADDR_LED0_GREEN,   I2C_REG_ADDR_LED4_BLUE,                             onWriteLeds},
+    {I2C_REG_LATENCY_BOUND_0,   I2C_REG_LATENCY_ISR_1,                              onWriteLatency},
+    {I2C_REG_RENDER_PERIOD,     I2C_REG_TOUCH_PERIOD,                               onWritePeriods},
+    {I2C_REG_POWER_MODE,        I2C_REG_POWER_MODE,                                 onWritePowerMode},
+    {I2C_REG_LED_POWER,         I2C_REG_LED_POWER,                                  onWriteIoLines},
+    {I2C_REG_TOUCH_PRESS,       I2C_REG_TOUCH_DEBOUNCE,                             onWriteTouchThresholds},
+    {I2C_REG_EVENT_COUNT,       I2C_REG_EVENT_DATA + I2C_EVENT_WINDOW * EVENT_SIZE - 1, onWriteEvents},
+    {I2C_REG_EVENT_IRQ,         I2C_REG_EVENT_IRQ,                                  onWriteIoLines},
+    {I2C_REG_TOUCH_STATS_MODE,  I2C_REG_TOUCH_STATS_MODE,                           onWriteTouchStatsMode},
+    {I2C_REG_I2C_CONFIG,        I2C_REG_I2C_CONFIG,                                 onWriteI2CConfig},
+    {I2C_REG_LED_COMMIT,        I2C_REG_LED_COMMIT,                                 onWriteLedCommit},
+    {I2C_REG_ANIMATION_CONTROL, I2C_REG_ANIMATION_CONTROL,                          onWriteAnimationControl},
+    {I2C_REG_EFFECT_COUNT,      I2C_REG_EFFECT_FLAGS,                               onWriteEffectSelect},
+};
 
+// A write to the EEPROM stays within the page it started in, the bytes are collected in
+// eeprom_write_buffer. Like a real EEPROM the address is not acknowledged for a while after
+// a write, so hosts can use acknowledge polling. task_eeprom() stores the write meanwhile.
+void onEepromWrite(uint16_t reg, uint16_t length) {
+    SetSecondaryI2CSlaveEnabled(false);
+    eeprom_write_offset = reg;
+    eeprom_write_length = length;
+    eeprom_write_time = SysTick->CNT;
+    RunSchedulerTaskAfter(TASK_EEPROM, EEPROM_WRITE_TIME * DELAY_MS_TIME);
+}
+
+// Register in the back bank of the I2C register snapshot, see task_registers()
+static inline volatile uint8_t* snapshot_register(uint16_t reg) {
+    return GetI2CSlaveBackRegister(reg);
+}
+
+void write_register_u16(volatile uint8_t* reg, uint16_t value) {
+    reg[0] = (value     ) & 0xFF;
+    reg[1] = (value >> 8) & 0xFF;
+}
+
+void write_register_u32(volatile uint8_t* reg, uint32_t value) {
+    reg[0] = (value      ) & 0xFF;
+    reg[1] = (value >>  8) & 0xFF;
+    reg[2] = (value >> 16) & 0xFF;
+    reg[3] = (value >> 24) & 0xFF;
 }
 
 uint8_t read_other_inputs() {
@@ -219,6 +809,457 @@ uint8_t read_other_inputs() {
     return value;
 }
 
+// Inputs of the effects, see effects.h
+void fill_effect_context(effect_context_t* context, uint8_t gesture) {
+    context->now = GetSchedulerMillis();
+    context->touch = GetTouchPressed();
+    context->slider_contact = GetSliderContact();
+    context->slider_position = GetSliderPosition();
+    context->gesture = gesture;
+    context->social_level = social_level;
+    context->leds = led_effect_data;
+}
+
+// Tasks
+
+// Read touch inputs
+void task_touch() {
+    // Process the scan started in the previous run and start the next one, so the
+    // pads are scanned in the background while the other tasks run
+    uint32_t raw_touch_value[5] = {0};
+    bool scanned = GetTouchScan(raw_touch_value);
+    bool tagged = touch_scan_tagged;
+    touch_scan_tagged = addressable_leds_busy();
+    StartTouchScan();
+    if (!scanned) {
+        return;
+    }
+
+    uint8_t previous = GetTouchPressed();
+    UpdateTouch(raw_touch_value, touch_value);
+    uint8_t pressed = GetTouchPressed();
+
+    uint32_t now = GetSchedulerMillis();
+    for (uint8_t i = 0; i < 5; i++) {
+        uint8_t mask = 1 << i;
+        if ((pressed ^ previous) & mask) {
+            queue_input_event((pressed & mask) ? EVENT_PRESS : EVENT_RELEASE, EVENT_SOURCE_TOUCH0 + i);
+            touch_press_time[i] = now;
+            touch_long_event &= ~mask;
+        } else if ((pressed & mask) && !(touch_long_event & mask) && now - touch_press_time[i] >= INPUT_LONG_PRESS) {
+            queue_input_event(EVENT_LONG_PRESS, EVENT_SOURCE_TOUCH0 + i);
+            touch_long_event |= mask;
+        }
+    }
+
+    if (touch_stats_reset) {
+        touch_stats_reset = false;
+        SetupTouchStats();
+        touch_tagged_scans = 0;
+    }
+    if (tagged) {
+        touch_tagged_scans++;
+    }
+    if (touch_stats_mode == TOUCH_STATS_ALL || (touch_stats_mode == TOUCH_STATS_LED_ACTIVE) == tagged) {
+        UpdateTouchStats(touch_value, pressed);
+    }
+
+    uint8_t gesture = UpdateSlider(touch_value, pressed, now);
+    if (gesture != SLIDER_GESTURE_NONE) {
+        queue_input_event(slider_gesture_events[gesture], EVENT_SOURCE_SLIDER);
+    }
+
+    for (uint8_t i = 0; i < 5; i++) {
+        if (IsTouchPressed(i)) {
+            social_level = i;
+        }
+    }
+
+    const effect_t* effect = FindEffect(system_mode);
+    if (effect && effect->on_touch) {
+        effect_context_t context;
+        fill_effect_context(&context, gesture);
+        effect->on_touch(effect, &context);
+    }
+}
+
+// Read and debounce the button
+void task_button() {
+    bool raw = !funDigitalRead(PIN_BUTTON);
+    if (raw != button_raw) {
+        button_raw = raw;
+        button_samples = 0;
+        return;
+    }
+    if (button_samples < BUTTON_DEBOUNCE_SAMPLES) {
+        button_samples++;
+        return;
+    }
+
+    prev_button = button;
+    button = raw;
+    if (button != prev_button) {
+        queue_input_event(button ? EVENT_PRESS : EVENT_RELEASE, EVENT_SOURCE_BUTTON);
+    }
+    if (button && !prev_button) {
+        button_press_time = SysTick->CNT;
+        button_press_mode = system_mode;
+        if (button_enabled) {
+            system_mode = NextEffectMode(system_mode);
+            led_frame_dirty = true;
+        }
+    }
+
+    uint32_t held = SysTick->CNT - button_press_time;
+    if (!button) {
+        button_long = false;
+        button_long_event = false;
+    } else if (!button_long_event && held >= INPUT_LONG_PRESS * DELAY_MS_TIME) {
+        button_long_event = true;
+        queue_input_event(EVENT_LONG_PRESS, EVENT_SOURCE_BUTTON);
+    }
+
+    if (button && button_enabled && !button_long && held >= BUTTON_LONG_PRESS * DELAY_MS_TIME) {
+        // Long press turns the badge off, it comes back in the mode it was in before the press
+        button_long = true;
+        badge_off_return_mode = button_press_mode;
+        system_mode = SYSTEM_MODE_OFF;
+    }
+}
+
+_Static_assert(SCHEDULER_CYCLES_PER_TICK <= 16, "GetI2CSlaveTimePerByte() scale out of range");
+
+// Update I2C registers. The values are written into the back bank and published at once,
+// so a host reading several registers in one transaction gets them from the same run.
+// While a read is still served from the back bank this run is skipped, the next run
+// publishes the values instead.
+void task_registers() {
+    if (!i2c_enabled || I2CSlaveBackBufferBusy()) {
+        return; // Nobody to read them, or the back bank is in use
+    }
+
+    // The LED DMA and ADC handlers can delay the I2C interrupt, the longest of them counts as blocked time
+    uint32_t blocked = addressable_leds_isr_max_time();
+    if (GetTouchScanIsrMaxTime() > blocked) blocked = GetTouchScanIsrMaxTime();
+    uint32_t latency_bound = GetI2CSlaveLatencyBound(blocked) / DELAY_US_TIME;
+    uint32_t latency_isr = i2c_slave_state.isr_max_time / DELAY_US_TIME;
+    if (latency_bound > 0xFFFF) latency_bound = 0xFFFF;
+    if (latency_isr > 0xFFFF) latency_isr = 0xFFFF;
+    uint32_t load = GetI2CSlaveTimePerByte(SCHEDULER_CYCLES_PER_TICK);
+    if (load > 0xFFFF) load = 0xFFFF;
+    uint32_t touch_scan_isr = GetTouchScanIsrTime() / DELAY_US_TIME;
+    if (touch_scan_isr > 0xFFFF) touch_scan_isr = 0xFFFF;
+
+    *snapshot_register(I2C_REG_FW_VERSION_0) = (FW_VERSION     ) & 0xFF;
+    *snapshot_register(I2C_REG_FW_VERSION_1) = (FW_VERSION >> 8) & 0xFF;
+    *snapshot_register(I2C_REG_GPIO_INPUTS) = read_other_inputs();
+    *snapshot_register(I2C_REG_SOCIAL_LEVEL) = social_level;
+    *snapshot_register(I2C_REG_RAINBOW_SPEED) = effect_rainbow_state.speed;
+    *snapshot_register(I2C_REG_KNIGHTRIDER_SPEED) = effect_knightrider_state.speed;
+    *snapshot_register(I2C_REG_BUTTON) = (button & 1) | ((prev_button & 1) << 1);
+    *snapshot_register(I2C_REG_BUTTON_ENABLED) = button_enabled;
+    *snapshot_register(I2C_REG_POWER_MODE) = power_mode;
+    *snapshot_register(I2C_REG_LED_POWER) = led_power_config;
+    *snapshot_register(I2C_REG_EVENT_IRQ) = event_irq_config;
+    for (uint8_t i = 0; i < 5; i++) {
+        write_register_u16(snapshot_register(I2C_REG_TOUCH_BASELINE + i * 2), GetTouchBaseline(i));
+    }
+    *snapshot_register(I2C_REG_TOUCH_FROZEN) = GetTouchBaselineFrozen();
+    for (uint8_t i = 0; i < 5; i++) {
+        write_register_u16(snapshot_register(I2C_REG_TOUCH_PRESS + i * 2), touch_state.press_threshold[i]);
+        write_register_u16(snapshot_register(I2C_REG_TOUCH_RELEASE + i * 2), touch_state.release_threshold[i]);
+    }
+    *snapshot_register(I2C_REG_TOUCH_DEBOUNCE) = touch_state.debounce;
+    *snapshot_register(I2C_REG_TOUCH_PRESSED) = GetTouchPressed();
+    *snapshot_register(I2C_REG_SLIDER_POSITION) = GetSliderPosition();
+    *snapshot_register(I2C_REG_SLIDER_CONTACT) = GetSliderContact();
+    write_register_u16(snapshot_register(I2C_REG_SLIDER_VELOCITY_0), GetSliderVelocity());
+    write_register_u16(snapshot_register(I2C_REG_SLIDER_SWIPE_0), GetSliderSwipeSpeed());
+    for (uint8_t i = 0; i < 5; i++) {
+        volatile uint8_t* stats = snapshot_register(I2C_REG_TOUCH_STATS + i * I2C_TOUCH_STATS_SIZE);
+        uint32_t variance = GetTouchStatsVariance(i);
+        write_register_u16(stats + I2C_TOUCH_STATS_MIN, GetTouchStatsMin(i));
+        write_register_u16(stats + I2C_TOUCH_STATS_MAX, GetTouchStatsMax(i));
+        write_register_u16(stats + I2C_TOUCH_STATS_VARIANCE, variance > 0xFFFF ? 0xFFFF : variance);
+        write_register_u16(stats + I2C_TOUCH_STATS_SNR, GetTouchStatsSnr(i));
+    }
+    *snapshot_register(I2C_REG_TOUCH_STATS_MODE) = touch_stats_mode;
+    write_register_u16(snapshot_register(I2C_REG_SETTINGS_WRITES_0), GetSettingsWrites());
+    write_register_u16(snapshot_register(I2C_REG_SETTINGS_ERASES_0), GetSettingsErases());
+    write_register_u16(snapshot_register(I2C_REG_SETTINGS_LIFE_0), GetSettingsEndurance());
+    write_register_u16(snapshot_register(I2C_REG_TOUCH_TAGGED_0), touch_tagged_scans);
+    write_register_u16(snapshot_register(I2C_REG_TOUCH_SCAN_ISR_0), touch_scan_isr);
+    write_register_u16(snapshot_register(I2C_REG_DUTY_CYCLE_0), GetSchedulerDutyCycle());
+    for (uint8_t i = 0; i < 5; i++) {
+        write_register_u16(snapshot_register(I2C_REG_TOUCH0_0 + i * 2), touch_value[i]);
+    }
+    *snapshot_register(I2C_REG_LATENCY_BOUND_0) = (latency_bound     ) & 0xFF;
+    *snapshot_register(I2C_REG_LATENCY_BOUND_1) = (latency_bound >> 8) & 0xFF;
+    *snapshot_register(I2C_REG_LATENCY_ISR_0) = (latency_isr     ) & 0xFF;
+    *snapshot_register(I2C_REG_LATENCY_ISR_1) = (latency_isr >> 8) & 0xFF;
+    write_register_u16(snapshot_register(I2C_REG_I2C_LOAD_0), load);
+    write_register_u16(snapshot_register(I2C_REG_LED_RECEIVED_0), led_mailbox_received);
+    write_register_u16(snapshot_register(I2C_REG_LED_SHOWN_0), led_mailbox_shown);
+    write_register_u16(snapshot_register(I2C_REG_LED_DROPPED_0), led_mailbox_dropped);
+    *snapshot_register(I2C_REG_ANIMATION_STATUS) = (AnimationValid() ? ANIMATION_STATUS_VALID : 0) |
+                                          (AnimationWaiting() ? ANIMATION_STATUS_WAITING : 0) |
+                                          (AnimationFinished() ? ANIMATION_STATUS_FINISHED : 0);
+    *snapshot_register(I2C_REG_ANIMATION_FRAME) = GetAnimationKeyframe();
+    *snapshot_register(I2C_REG_EFFECT_VM_ERROR) = GetEffectVmError();
+    write_register_u16(snapshot_register(I2C_REG_EFFECT_VM_STEPS_0), GetEffectVmSteps());
+    *snapshot_register(I2C_REG_LED_FRAMES_SENT_0) = (led_frames_sent     ) & 0xFF;
+    *snapshot_register(I2C_REG_LED_FRAMES_SENT_1) = (led_frames_sent >> 8) & 0xFF;
+    *snapshot_register(I2C_REG_LED_FRAMES_SKIP_0) = (led_frames_skipped     ) & 0xFF;
+    *snapshot_register(I2C_REG_LED_FRAMES_SKIP_1) = (led_frames_skipped >> 8) & 0xFF;
+    *snapshot_register(I2C_REG_RENDER_PERIOD) = tasks[TASK_RENDER].period / DELAY_MS_TIME;
+    *snapshot_register(I2C_REG_TOUCH_PERIOD) = tasks[TASK_TOUCH].period / DELAY_MS_TIME;
+    for (uint8_t i = 0; i < NUM_TASKS; i++) {
+        volatile uint8_t* stats = snapshot_register(I2C_REG_TASK_STATS + i * I2C_TASK_STATS_SIZE);
+        write_register_u16(stats + I2C_TASK_STATS_RUN_COUNT, tasks[i].run_count);
+        write_register_u32(stats + I2C_TASK_STATS_LAST, tasks[i].last_duration);
+        write_register_u32(stats + I2C_TASK_STATS_MAX, tasks[i].max_duration);
+    }
+    PublishI2CSlaveRegisters();
+}
+
+// Copy the current settings into the settings store, returns true if any of them changed
+bool update_settings() {
+    bool changed = false;
+    if (system_mode == 0 || FindEffect(system_mode)) {
+        changed |= SetSetting(SETTING_SYSTEM_MODE, system_mode);
+    }
+    changed |= SetSetting(SETTING_SOCIAL_LEVEL, social_level);
+    changed |= SetSetting(SETTING_RAINBOW_SPEED, effect_rainbow_state.speed);
+    changed |= SetSetting(SETTING_KNIGHTRIDER_SPEED, effect_knightrider_state.speed);
+    changed |= SetSetting(SETTING_BUTTON_ENABLED, button_enabled);
+    changed |= SetSetting(SETTING_TOUCH_DEBOUNCE, touch_state.debounce);
+    for (uint8_t i = 0; i < 5; i++) {
+        uint16_t stored;
+        uint16_t baseline = GetTouchBaseline(i);
+        if (!GetSetting(SETTING_TOUCH_BASELINE + i, &stored) || baseline > stored + SETTINGS_BASELINE_TOLERANCE || baseline + SETTINGS_BASELINE_TOLERANCE < stored) {
+            changed |= SetSetting(SETTING_TOUCH_BASELINE + i, baseline);
+        }
+        changed |= SetSetting(SETTING_TOUCH_PRESS + i, touch_state.press_threshold[i]);
+        changed |= SetSetting(SETTING_TOUCH_RELEASE + i, touch_state.release_threshold[i]);
+    }
+    return changed;
+}
+
+// Restore the settings at boot
+void restore_settings() {
+    uint16_t value;
+    // Mode 0 shows what a host writes to the LED registers, without a host the LEDs would stay dark
+    if (GetSetting(SETTING_SYSTEM_MODE, &value) && (value != 0 || (get_mode() && i2c_enabled))) system_mode = value;
+    if (GetSetting(SETTING_SOCIAL_LEVEL, &value)) social_level = value;
+    if (GetSetting(SETTING_RAINBOW_SPEED, &value)) effect_rainbow_state.speed = value;
+    if (GetSetting(SETTING_KNIGHTRIDER_SPEED, &value)) effect_knightrider_state.speed = value;
+    if (GetSetting(SETTING_TOUCH_DEBOUNCE, &value)) SetTouchDebounce(value);
+
+    // Without a host the button is the only way to change the mode, so it can only be disabled under I2C control
+    if (get_mode() && GetSetting(SETTING_BUTTON_ENABLED, &value)) button_enabled = value;
+
+    for (uint8_t i = 0; i < 5; i++) {
+        uint16_t press, release;
+        if (GetSetting(SETTING_TOUCH_PRESS + i, &press) && GetSetting(SETTING_TOUCH_RELEASE + i, &release)) {
+            SetTouchThresholds(i, press, release);
+        }
+    }
+
+    // The baseline measured at boot is wrong if a pad was touched at power-on, in which case the stored one is used
+    uint32_t raw_touch_value[5] = {0};
+    read_touch(raw_touch_value);
+    for (uint8_t i = 0; i < 5; i++) {
+        if (GetSetting(SETTING_TOUCH_BASELINE + i, &value) && (int32_t) raw_touch_value[i] - value > (int32_t) touch_state.release_threshold[i]) {
+            SetTouchBaseline(i, value);
+        }
+    }
+
+    // The control registers are read back when the host writes them
+    SetI2CSlaveRegister(I2C_REG_MODE, system_mode);
+    SetI2CSlaveRegister(I2C_REG_SOCIAL_LEVEL, social_level);
+    SetI2CSlaveRegister(I2C_REG_RAINBOW_SPEED, effect_rainbow_state.speed);
+    SetI2CSlaveRegister(I2C_REG_KNIGHTRIDER_SPEED, effect_knightrider_state.speed);
+    SetI2CSlaveRegister(I2C_REG_BUTTON_ENABLED, button_enabled);
+}
+
+// Save settings to flash once they have stopped changing
+void task_settings() {
+    if (!update_settings() && SettingsDirty()) {
+        wait_addressable_leds();
+        SaveSettings();
+    }
+}
+
+// Store the last write by the host into the EEPROM. While it is pending the EEPROM address
+// is not acknowledged, so the window can be moved to the page that was written.
+void finish_eeprom_write() {
+    if (eeprom_write_length == 0) {
+        return;
+    }
+    wait_addressable_leds(); // A write to another page first writes the previous one to flash
+    uint16_t page = eeprom_write_offset & ~(EEPROM_PAGE_SIZE - 1);
+    for (uint8_t i = 0; i < eeprom_write_length; i++) {
+        uint8_t index = (eeprom_write_offset + i) & (EEPROM_PAGE_SIZE - 1);
+        WriteEeprom(page | index, eeprom_write_buffer[index]);
+    }
+    eeprom_write_length = 0;
+    if (page >= ANIMATION_EEPROM_OFFSET) {
+        eeprom_animation_written = true;
+    }
+    SetSecondaryI2CSlaveWindow(GetEepromPage(), GetEepromPageOffset(), FLASH_PAGE_SIZE);
+}
+
+// End the EEPROM write cycle and write the EEPROM to flash once the host has stopped writing
+void task_eeprom() {
+    if (!i2c_enabled) {
+        return;
+    }
+    uint16_t flushes = GetEepromFlushes();
+    finish_eeprom_write();
+    SetSecondaryI2CSlaveEnabled(true);
+    if (EepromDirty() && SysTick->CNT - eeprom_write_time >= EEPROM_FLUSH_DELAY * DELAY_MS_TIME) {
+        wait_addressable_leds();
+        FlushEeprom();
+    }
+    // The animation and effect programs are read from flash
+    if (eeprom_animation_written && GetEepromFlushes() != flushes) {
+        effect_restart = true;
+        eeprom_animation_written = EepromDirty();
+    }
+}
+
+// Render the current system mode
+void task_render() {
+    if (system_mode == 0) {
+        // I2C controls LEDs
+        if (led_mailbox_pending) {
+            // A committed frame is always sent, even when it is the same as the last one
+            I2CSlaveLock();
+            memcpy((uint8_t*) led_effect_data, led_mailbox, 15);
+            led_mailbox_pending = false;
+            I2CSlaveUnlock();
+            led_mailbox_shown++;
+            led_frame_dirty = true;
+            update_addressable_leds((uint8_t*) led_effect_data, 15);
+        } else if (led_mailbox_active) {
+            update_addressable_leds((uint8_t*) led_effect_data, 15);
+        } else {
+            update_addressable_leds((uint8_t*) &i2c_registers[I2C_REG_ADDR_LED0_GREEN], 15);
+        }
+        return;
+    }
+
+    const effect_t* effect = FindEffect(system_mode);
+    if (effect) {
+        effect_context_t context;
+        fill_effect_context(&context, SLIDER_GESTURE_NONE);
+        if (effect != effect_current || effect_restart) {
+            effect_current = effect;
+            effect_restart = false;
+            StartEffect(effect, &context);
+        }
+        effect->step(effect, &context);
+    }
+
+    if (system_mode != SYSTEM_MODE_LATENCY_BENCH) {
+        update_addressable_leds((uint8_t*) led_effect_data, 15);
+    }
+}
+
+// Button edge makes the button task run immediately, SCL edges are only enabled while the badge is off
+void EXTI7_0_IRQHandler(void) __attribute__((interrupt));
+void EXTI7_0_IRQHandler(void) {
+    uint32_t flags = EXTI->INTFR;
+    EXTI->INTFR = flags;
+    if (flags & EXTI_Line7) {
+        RunSchedulerTaskNow(TASK_BUTTON);
+    }
+    exti_wakeup = true;
+}
+
+// Badge off: blank the LEDs, cut their power if a switch is fitted and stay in standby
+// until a touch pad, the button or I2C activity wakes the badge up again
+void badge_off() {
+    // Releasing the button would wake the badge up immediately, and so would
+    // contact bounce after the release
+    uint32_t released = SysTick->CNT;
+    while (SysTick->CNT - released < BADGE_OFF_RELEASE * DELAY_MS_TIME) {
+        if (!funDigitalRead(PIN_BUTTON)) {
+            released = SysTick->CNT;
+        }
+    }
+
+    // Power may be removed while the badge is off
+    finish_eeprom_write();
+    wait_addressable_leds();
+    FlushEeprom();
+    update_settings();
+    SaveSettings();
+
+    memset((uint8_t*) led_effect_data, 0, sizeof(led_effect_data));
+    write_addressable_leds((uint8_t*) led_effect_data, 15);
+    wait_addressable_leds();
+    set_led_power(false);
+
+    // The auto wakeup timer runs from the LSI and periodically wakes the CPU to scan the touch pads
+    RCC->APB1PCENR |= RCC_APB1Periph_PWR;
+    RCC->RSTSCKR |= RCC_LSION;
+    while (!(RCC->RSTSCKR & RCC_LSIRDY));
+    PWR->AWUPSC = PWR_AWU_Prescaler_2048; // 128 kHz / 2048, 16 ms per tick
+    PWR->AWUWR = BADGE_OFF_AWU_WINDOW;
+    PWR->AWUCSR |= PWR_AWUCSR_AWUEN;
+    EXTI->EVENR |= EXTI_Line9;
+    EXTI->FTENR |= EXTI_Line9;
+
+    // The button and a falling edge on SCL wake the CPU up, the I2C transfer that caused it is not acknowledged
+    EXTI->EVENR |= EXTI_Line7;
+    if (i2c_enabled) {
+        AFIO->EXTICR = (AFIO->EXTICR & ~(3 << (2 * 2))) | (2 << (2 * 2)); // EXTI2 on port C
+        EXTI->FTENR |= EXTI_Line2;
+        EXTI->EVENR |= EXTI_Line2;
+        EXTI->INTENR |= EXTI_Line2;
+    }
+
+    // The edges of the release are still pending, only a new press may wake the badge up
+    EXTI->INTFR = EXTI_Line7;
+    exti_wakeup = false;
+    while (!exti_wakeup) {
+        PWR->CTLR |= PWR_CTLR_PDDS; // Standby
+        PFIC->SCTLR |= (1 << 2); // Deep sleep
+        __WFE();
+        PFIC->SCTLR &= ~(1 << 2);
+        SystemInit(); // Restore the system clock
+
+        if (!exti_wakeup) {
+            // Woken up by the auto wakeup timer
+            uint32_t raw_touch_value[5] = {0};
+            read_touch(raw_touch_value);
+            for (uint8_t i = 0; i < 5; i++) {
+                if (GetTouchDelta(i, raw_touch_value[i]) > (int32_t) touch_state.press_threshold[i]) {
+                    exti_wakeup = true;
+                }
+            }
+        }
+    }
+
+    PWR->AWUCSR &= ~PWR_AWUCSR_AWUEN;
+    EXTI->EVENR &= ~(EXTI_Line2 | EXTI_Line7 | EXTI_Line9);
+    EXTI->FTENR &= ~(EXTI_Line2 | EXTI_Line9);
+    EXTI->INTENR &= ~EXTI_Line2;
+
+    set_led_power(true);
+
+    // A button press that woke the badge up must not also change the mode
+    button = button_raw = prev_button = !funDigitalRead(PIN_BUTTON);
+    button_long = button;
+    button_long_event = button;
+
+    system_mode = badge_off_return_mode;
+    SetI2CSlaveRegister(I2C_REG_MODE, system_mode);
+    led_frame_dirty = true;
+    ResyncScheduler();
+}
+
 int main() {
     SystemInit();
     funGpioInitAll();
@@ -226,6 +1267,7 @@ int main() {
     // Enable ADC
 	RCC->APB2PCENR |= RCC_APB2Periph_ADC1;
 	InitTouchADC();
+    SetupTouchScan(touch_channels, 5, NULL);
 
     // Mode jumper
     funPinMode(PIN_MODE, GPIO_CFGLR_IN_PUPD);
@@ -243,6 +1285,13 @@ int main() {
     funPinMode(PIN_BUTTON, GPIO_CFGLR_IN_PUPD);
     funDigitalWrite(PIN_BUTTON, true); // Pull-up
 
+    // Interrupt on both edges of the button, to wake up from sleep
+    RCC->APB2PCENR |= RCC_APB2Periph_AFIO;
+    AFIO->EXTICR = (AFIO->EXTICR & ~(3 << (7 * 2))) | (2 << (7 * 2)); // EXTI7 on port C
+    EXTI->INTENR |= EXTI_Line7;
+    EXTI->FTENR |= EXTI_Line7;
+    EXTI->RTENR |= EXTI_Line7;
+
     // Testpoint 1
     funPinMode(PIN_E1, GPIO_CFGLR_IN_PUPD);
     funDigitalWrite(PIN_E1, true); // Pull-up
@@ -252,7 +1301,13 @@ int main() {
     funDigitalWrite(PIN_E2, true); // Pull-up
 
     // LEDs
-    funPinMode(PIN_LED, GPIO_CFGLR_OUT_10Mhz_PP);
+    funPinMode(PIN_LED, GPIO_CFGLR_OUT_10Mhz_AF_PP);
+    setup_addressable_leds();
+
+    // The EEPROM holds the animation, so it is also needed without I2C
+    SetupEeprom();
+    SetupAnimation(GetEepromData() + ANIMATION_EEPROM_OFFSET, EEPROM_SIZE - ANIMATION_EEPROM_OFFSET);
+    SetupEffectVm(GetEepromData() + ANIMATION_EEPROM_OFFSET, EEPROM_SIZE - ANIMATION_EEPROM_OFFSET);
 
     // Check if I2C bus is usable
     // This is done by enabling the internal pull-down resistors and checking the state of both SCL and SDA.
@@ -267,9 +1322,19 @@ int main() {
         funPinMode(PIN_SDA, GPIO_CFGLR_OUT_10Mhz_AF_OD);
         funPinMode(PIN_SCL, GPIO_CFGLR_OUT_10Mhz_AF_OD);
 
+        i2c_enabled = true;
+
         // Initialize I2C in peripheral mode
-        SetupI2CSlave(I2C_ADDR_CONTROL, i2c_registers, sizeof(i2c_registers), onWrite, onRead, false);
-        SetupSecondaryI2CSlave(I2C_ADDR_EEPROM, (uint8_t*) eeprom_registers, sizeof(eeprom_registers), NULL, NULL, true);
+        SetupI2CSlave(I2C_ADDR_CONTROL, i2c_registers, sizeof(i2c_registers), NULL, onRead, false);
+        SetI2CSlaveShadow(i2c_shadow_registers, i2c_shadow_ranges, sizeof(i2c_shadow_ranges) / sizeof(i2c_shadow_ranges[0]));
+        SetI2CSlaveReadCallbackRange(I2C_REG_EVENT_COUNT, I2C_REG_EVENT_COUNT);
+        SetI2CSlaveReadDoneCallback(onReadDone);
+        SetI2CSlaveWriteHandlers(i2c_write_handlers, sizeof(i2c_write_handlers) / sizeof(i2c_write_handlers[0]));
+        // Reads come straight from flash, writes are collected in a buffer
+        SetupSecondaryI2CSlave(I2C_ADDR_EEPROM, (volatile uint8_t*) GetEepromData(), EEPROM_SIZE, onEepromWrite, NULL, false);
+        SetSecondaryI2CSlavePageSize(EEPROM_PAGE_SIZE);
+        SetSecondaryI2CSlaveWriteBuffer(eeprom_write_buffer);
+        SetSecondaryI2CSlaveWideAddressing(EEPROM_SIZE > 256); // Like a 24C32 and up
     } else {
         for (uint8_t i = 0; i < 5; i++) {
             led_effect_data[i * 3 + 0] = 0x00;
@@ -280,264 +1345,42 @@ int main() {
         Delay_Ms(100);
     }
 
-    uint8_t hue = 0;
+    uint32_t initial_touch_value[5] = {0};
+    read_touch(initial_touch_value);
+    SetupTouch(initial_touch_value);
+    SetupSlider();
+    SetupTouchStats();
 
-    uint32_t baseline[5] = {0};
-    read_touch(baseline);
-
-    rainbow_speed = 15; // Default speed of the rainbow
+    SetupEffects();
 
     if (!get_mode()) {
         system_mode = 1;
         button_enabled = true;
     }
 
-    bool prev_button = false;
-
-    while (1) {
-        uint32_t now = SysTick->CNT;
-        if (now - input_poll_previous >= poll_interval_inputs) {
-            input_poll_previous = now;
+    SetupSettings();
+    restore_settings();
+    update_settings();
+    update_effect_registers();
 
-            // Read touch inputs
-            uint32_t raw_touch_value[5] = {0};
-            read_touch(raw_touch_value);
+    SetupScheduler(tasks, NUM_TASKS);
+    NVIC_EnableIRQ(EXTI7_0_IRQn);
 
-            int32_t touch_value[5] = {0};
-            for (uint8_t i = 0; i < 5; i++) {
-                touch_value[i] = raw_touch_value[i] - baseline[i];
-                if (touch_value[i] > 1900) {
-                    social_level = i;
-                }
-            }
+    while (1) {
+        if (system_mode == SYSTEM_MODE_OFF) {
+            badge_off();
+        } else {
+            badge_off_return_mode = system_mode;
+        }
 
-            // Read button
-            bool button = !funDigitalRead(PIN_BUTTON);
-            if (button && !prev_button && button_enabled) {
-                system_mode++;
-                if (system_mode > 9) system_mode = 1;
-            }
-            prev_button = button;
-
-            // Update I2C registers
-            I2C1->CTLR2 &= ~(I2C_CTLR2_ITEVTEN); // Disable I2C event interrupt
-            i2c_registers[I2C_REG_FW_VERSION_0] = (FW_VERSION     ) & 0xFF;
-            i2c_registers[I2C_REG_FW_VERSION_1] = (FW_VERSION >> 8) & 0xFF;
-            i2c_registers[I2C_REG_GPIO_INPUTS] = read_other_inputs();
-            i2c_registers[I2C_REG_SOCIAL_LEVEL] = social_level;
-            i2c_registers[I2C_REG_RAINBOW_SPEED] = rainbow_speed;
-            i2c_registers[I2C_REG_KNIGHTRIDER_SPEED] = knightrider_speed;
-            i2c_registers[I2C_REG_BUTTON] = (button & 1) | ((prev_button & 1) << 1);
-            i2c_registers[I2C_REG_BUTTON_ENABLED] = button_enabled;
-            for (uint8_t i = 0; i < 5; i++) {
-                uint16_t* touch_i2c_reg = (uint16_t*)&i2c_registers[I2C_REG_TOUCH0_0 + i * 2];
-                *touch_i2c_reg = touch_value[i];
-            }
-            I2C1->CTLR2 |= I2C_CTLR2_ITEVTEN; // Enable I2C event interrupt
-
-
-            switch (system_mode) {
-                case 0:
-                    // I2C controls LEDs
-                    write_addressable_leds((uint8_t*) &i2c_registers[I2C_REG_ADDR_LED0_GREEN], 15);
-                    break;
-                case 1: {
-                    // Social battery
-                    for (uint8_t i = 0; i < 5; i++) {
-                        if (social_level < i) {
-                            led_effect_data[(i * 3) + 0] = 0;
-                            led_effect_data[(i * 3) + 1] = 0;
-                        } else {
-                            led_effect_data[(i * 3) + 0] = 50 * social_level;
-                            led_effect_data[(i * 3) + 1] = 0xFF - 50 * social_level;
-                        }
-                        led_effect_data[(i * 3) + 2] = touch_value[i] > 1900 ? 0xFF : 0x00;
-                    }
-                    break;
-                }
-                case 2: {
-                    // Rainbow
-                    for (uint8_t led = 0; led < 5; led++) {
-                        uint32_t color = EHSVtoHEX(hue + (led*rainbow_speed), 240, 128);
-                        led_effect_data[(led * 3) + 0] = (color >>  8) & 0xFF;
-                        led_effect_data[(led * 3) + 1] = (color >> 16) & 0xFF;
-                        led_effect_data[(led * 3) + 2] = (color >>  0) & 0xFF;
-                        if (touch_value[led] > 1900) {
-                            led_effect_data[(led * 3) + 0] = 0xFF;
-                            led_effect_data[(led * 3) + 1] = 0xFF;
-                            led_effect_data[(led * 3) + 2] = 0xFF;
-                            if (led==1) {
-                                if (rainbow_speed > 0x00) {
-                                    rainbow_speed--;
-                                }
-                            }
-                            if (led==3) {
-                                rainbow_speed = 15; // Reset
-                            }
-                            if (led==4) {
-                                if (rainbow_speed < 0xFF) {
-                                    rainbow_speed++;
-                                }
-                            }
-                        }
-                    }
-                    hue++;
-                    break;
-                }
-                case 3: {
-                    // Transgender colors
-                    led_effect_data[0] = 0; // G
-                    led_effect_data[1] = 0; // R
-                    led_effect_data[2] = 255; // B
-                    led_effect_data[3] = 150; // G
-                    led_effect_data[4] = 255; // R
-                    led_effect_data[5] = 174; // B
-                    led_effect_data[6] = 255;
-                    led_effect_data[7] = 255;
-                    led_effect_data[8] = 255;
-                    led_effect_data[9] = 150; // G
-                    led_effect_data[10] = 255; // R
-                    led_effect_data[11] = 174; // B
-                    led_effect_data[12] = 0; // G
-                    led_effect_data[13] = 0; // R
-                    led_effect_data[14] = 255; // B
-                    if (touch_value[0] > 1900) {
-                        led_effect_data[0] = 150; // G
-                        led_effect_data[1] = 255; // R
-                        led_effect_data[2] = 174; // B
-                    }
-                    if (touch_value[1] > 1900) {
-                        led_effect_data[3] = 0; // G
-                        led_effect_data[4] = 0; // R
-                        led_effect_data[5] = 255; // B
-                    }
-                    if (touch_value[2] > 1900) {
-                        uint32_t color = EHSVtoHEX(hue, 240, 128);
-                        led_effect_data[6] = (color >>  8) & 0xFF;
-                        led_effect_data[7] = (color >> 16) & 0xFF;
-                        led_effect_data[8] = (color >>  0) & 0xFF;
-                        hue += 10;
-                    }
-                    if (touch_value[3] > 1900) {
-                        led_effect_data[9] = 0; // G
-                        led_effect_data[10] = 0; // R
-                        led_effect_data[11] = 255; // B
-                    }
-                    if (touch_value[4] > 1900) {
-                        led_effect_data[12] = 150; // G
-                        led_effect_data[13] = 255; // R
-                        led_effect_data[14] = 174; // B
-                    }
-                    break;
-                }
-                case 4: {
-                    // Dutch flag colors
-                    led_effect_data[0] = 0; // G
-                    led_effect_data[1] = 255; // R
-                    led_effect_data[2] = 0; // B
-                    led_effect_data[3] = 0; // G
-                    led_effect_data[4] = 255; // R
-                    led_effect_data[5] = 0; // B
-                    led_effect_data[6] = 255;
-                    led_effect_data[7] = 255;
-                    led_effect_data[8] = 255;
-                    led_effect_data[9] = 0; // G
-                    led_effect_data[10] = 0; // R
-                    led_effect_data[11] = 255; // B
-                    led_effect_data[12] = 0; // G
-                    led_effect_data[13] = 0; // R
-                    led_effect_data[14] = 255; // B
-                    break;
-                }
-                case 5: {
-                    // Knightrider (red)
-                    knightrider_step(1);
-                    break;
-                }
-                case 6: {
-                    // Knightrider (green)
-                    knightrider_step(0);
-                    break;
-                }
-                case 7: {
-                    // Knightrider (blue)
-                    knightrider_step(2);
-                    break;
-                }
-                case 8: {
-                    // Party animals
-                    for (uint8_t i = 0; i < 15; i++) {
-                        led_effect_data[i] = 0xFF;
-                    }
-                    if (touch_value[0] > 1900) {
-                        uint32_t color = EHSVtoHEX(hue, 240, 128);
-                        led_effect_data[0] = (color >>  8) & 0xFF;
-                        led_effect_data[1] = (color >> 16) & 0xFF;
-                        led_effect_data[2] = (color >>  0) & 0xFF;
-                        hue += 10;
-                    }
-                    if (touch_value[1] > 1900) {
-                        uint32_t color = EHSVtoHEX(hue, 240, 128);
-                        led_effect_data[3] = (color >>  8) & 0xFF;
-                        led_effect_data[4] = (color >> 16) & 0xFF;
-                        led_effect_data[5] = (color >>  0) & 0xFF;
-                        hue += 10;
-                    }
-                    if (touch_value[2] > 1900) {
-                        uint32_t color = EHSVtoHEX(hue, 240, 128);
-                        led_effect_data[6] = (color >>  8) & 0xFF;
-                        led_effect_data[7] = (color >> 16) & 0xFF;
-                        led_effect_data[8] = (color >>  0) & 0xFF;
-                        hue += 10;
-                    }
-                    if (touch_value[3] > 1900) {
-                        uint32_t color = EHSVtoHEX(hue, 240, 128);
-                        led_effect_data[9] = (color >>  8) & 0xFF;
-                        led_effect_data[10] = (color >> 16) & 0xFF;
-                        led_effect_data[11] = (color >>  0) & 0xFF;
-                        hue += 10;
-                    }
-                    if (touch_value[4] > 1900) {
-                        uint32_t color = EHSVtoHEX(hue, 240, 128);
-                        led_effect_data[12] = (color >>  8) & 0xFF;
-                        led_effect_data[13] = (color >> 16) & 0xFF;
-                        led_effect_data[14] = (color >>  0) & 0xFF;
-                        hue += 10;
-                    }
-                    break;
-                }
-                case 9: {
-                    // Moving cats
-                    for (uint8_t i = 0; i < 15; i++) {
-                        led_effect_data[i] = 0;
-                    }
-                    if (touch_value[0] > 1900) {
-                        social_level = 0;
-                    }
-                    if (touch_value[1] > 1900) {
-                        social_level = 1;
-                    }
-                    if (touch_value[2] > 1900) {
-                        social_level = 2;
-                    }
-                    if (touch_value[3] > 1900) {
-                        social_level = 3;
-                    }
-                    if (touch_value[4] > 1900) {
-                        social_level = 4;
-                    }
-                    uint32_t color = EHSVtoHEX(hue, 240, 128);
-                    led_effect_data[social_level * 3 + 0] = (color >>  8) & 0xFF;
-                    led_effect_data[social_level * 3 + 1] = (color >> 16) & 0xFF;
-                    led_effect_data[social_level * 3 + 2] = (color >>  0) & 0xFF;
-                    hue += 10;
-                    break;
-                }
-            }
+        RunScheduler();
 
-            if (system_mode > 0) {
-                write_addressable_leds((uint8_t*) led_effect_data, 15);
-            }
+        if (system_mode == SYSTEM_MODE_LATENCY_BENCH) {
+            latency_bench_step();
+        } else if (power_mode == POWER_MODE_SLEEP) {
+            SchedulerSleep();
         }
+
+        UpdateSchedulerDutyCycle();
     }
 }
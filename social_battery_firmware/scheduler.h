@@ -0,0 +1,242 @@
+/*
+ * Single-File-Header for a cooperative task scheduler running on SysTick deadlines
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 Renze Nicolai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Tasks live in a static table owned by the application. Every task has a period
+// in SysTick ticks and runs when its deadline has passed, after which the deadline
+// moves one period further. A task that fell behind by more than a period is
+// rescheduled relative to the current time instead of running repeatedly to catch up.
+// RunSchedulerTaskNow() only sets a flag, so an interrupt handler can request a run
+// without racing with the deadline update in RunScheduler().
+//
+// For every task the number of runs, the duration of the last run and the longest
+// run are recorded in CPU cycles.
+//
+// Between deadlines the application can call SchedulerSleep(), which waits for
+// an interrupt with the SysTick compare interrupt set to the next deadline. Any
+// other interrupt (I2C, EXTI, DMA) wakes the core up early. The fraction of time
+// spent awake is measured over windows of SCHEDULER_DUTY_WINDOW ticks.
+//
+// GetSchedulerMillis() extends SysTick into a millisecond clock that does not
+// jump when the 32-bit counter wraps, as long as it is called at least once per wrap.
+
+#ifndef __SCHEDULER_H
+#define __SCHEDULER_H
+
+#include "ch32v003fun.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// SysTick runs at DELAY_US_TIME ticks per microsecond
+#define SCHEDULER_CYCLES_PER_TICK ((FUNCONF_SYSTEM_CORE_CLOCK / 1000000) / DELAY_US_TIME)
+
+#define SCHEDULER_DUTY_WINDOW (1000 * DELAY_MS_TIME)
+
+typedef void (*scheduler_function_t)(void);
+
+typedef struct {
+    scheduler_function_t function;
+    uint32_t period;        // SysTick ticks
+    uint32_t deadline;      // SysTick->CNT value at which the task runs next
+    uint16_t run_count;
+    volatile bool run_now;  // Run at the next RunScheduler() without moving the deadline
+    uint32_t last_duration; // Cycles
+    uint32_t max_duration;  // Cycles
+} scheduler_task_t;
+
+struct _scheduler_state {
+    scheduler_task_t* tasks;
+    uint8_t count;
+    uint32_t window_start;
+    uint32_t window_sleep; // Ticks spent sleeping in the current window
+    uint16_t duty_cycle;   // Fraction of the last window spent awake, in 0.1%
+    uint32_t millis;
+    uint32_t millis_last;  // SysTick->CNT value at the last millisecond clock update
+    uint32_t millis_ticks; // Ticks not yet counted as a full millisecond
+} scheduler_state;
+
+void SetupScheduler(scheduler_task_t* tasks, uint8_t count) {
+    scheduler_state.tasks = tasks;
+    scheduler_state.count = count;
+
+    uint32_t now = SysTick->CNT;
+    for (uint8_t i = 0; i < count; i++) {
+        tasks[i].deadline = now;
+        tasks[i].run_count = 0;
+        tasks[i].run_now = false;
+        tasks[i].last_duration = 0;
+        tasks[i].max_duration = 0;
+    }
+
+    scheduler_state.window_start = now;
+    scheduler_state.window_sleep = 0;
+    scheduler_state.duty_cycle = 1000;
+    scheduler_state.millis = 0;
+    scheduler_state.millis_last = now;
+    scheduler_state.millis_ticks = 0;
+
+    NVIC_EnableIRQ(SysTicK_IRQn);
+}
+
+// Make all tasks due now, after SysTick has been stopped or reinitialized
+void ResyncScheduler() {
+    uint32_t now = SysTick->CNT;
+    for (uint8_t i = 0; i < scheduler_state.count; i++) {
+        scheduler_state.tasks[i].deadline = now;
+    }
+    scheduler_state.window_start = now;
+    scheduler_state.window_sleep = 0;
+    scheduler_state.millis_last = now;
+}
+
+// Change the period of a task, the new period applies after its next run
+void SetSchedulerPeriod(uint8_t task, uint32_t period) {
+    scheduler_state.tasks[task].period = period;
+}
+
+// Run every task whose deadline has passed, returns true if any task ran
+bool RunScheduler() {
+    bool ran = false;
+    for (uint8_t i = 0; i < scheduler_state.count; i++) {
+        scheduler_task_t* task = &scheduler_state.tasks[i];
+        uint32_t start = SysTick->CNT;
+        uint32_t deadline = task->deadline;
+        bool due = (int32_t) (start - deadline) >= 0;
+        if (!due && !task->run_now) {
+            continue;
+        }
+
+        // Cleared before the run, a request made while the task runs is kept for the next call
+        task->run_now = false;
+        task->function();
+
+        uint32_t end = SysTick->CNT;
+        task->last_duration = (end - start) * SCHEDULER_CYCLES_PER_TICK;
+        if (task->last_duration > task->max_duration) {
+            task->max_duration = task->last_duration;
+        }
+        task->run_count++;
+
+        if (due) {
+            // Keep a deadline that RunSchedulerTaskAfter() set from an interrupt handler meanwhile
+            __disable_irq();
+            if (task->deadline == deadline) {
+                deadline += task->period;
+                if ((int32_t) (end - deadline) >= 0) {
+                    deadline = end + task->period; // Fell behind, skip the missed runs
+                }
+                task->deadline = deadline;
+            }
+            __enable_irq();
+        }
+        ran = true;
+    }
+    return ran;
+}
+
+// Run a task at the next RunScheduler(), for example from an interrupt handler. Its
+// periodic deadline stays where it was.
+void RunSchedulerTaskNow(uint8_t task) {
+    scheduler_state.tasks[task].run_now = true;
+}
+
+// Make a task due after delay ticks, from then on it runs at its normal period
+void RunSchedulerTaskAfter(uint8_t task, uint32_t delay) {
+    scheduler_state.tasks[task].deadline = SysTick->CNT + delay;
+}
+
+// SysTick->CNT value at which the first task is due, now if a run has been requested
+uint32_t GetSchedulerNextDeadline() {
+    uint32_t now = SysTick->CNT;
+    uint32_t next = now + 0x7FFFFFFF;
+    for (uint8_t i = 0; i < scheduler_state.count; i++) {
+        if (scheduler_state.tasks[i].run_now) {
+            return now;
+        }
+        if ((int32_t) (scheduler_state.tasks[i].deadline - next) < 0) {
+            next = scheduler_state.tasks[i].deadline;
+        }
+    }
+    return next;
+}
+
+// Sleep until the next deadline or until another interrupt wakes the core up
+void SchedulerSleep() {
+    // With interrupts masked an interrupt that becomes pending still ends WFI, but
+    // is only handled after the sleep time has been recorded. The deadline is read
+    // with interrupts masked so an interrupt handler cannot move a task forward
+    // after it has been read.
+    __disable_irq();
+    uint32_t deadline = GetSchedulerNextDeadline();
+    uint32_t start = SysTick->CNT;
+
+    // Clear the compare flag before arming the new compare value, then check the
+    // deadline again: if the counter passed it while CMP was written the flag may
+    // never be set and WFI would sleep until the counter wraps
+    SysTick->SR = 0;
+    SysTick->CMP = deadline;
+    SysTick->CTLR |= SYSTICK_CTLR_STIE;
+    if ((int32_t) (deadline - SysTick->CNT) > 0) {
+        __WFI();
+        scheduler_state.window_sleep += SysTick->CNT - start;
+    }
+    __enable_irq();
+}
+
+// Update the duty cycle measurement, call once per main loop iteration
+void UpdateSchedulerDutyCycle() {
+    uint32_t elapsed = SysTick->CNT - scheduler_state.window_start;
+    if (elapsed < SCHEDULER_DUTY_WINDOW) {
+        return;
+    }
+    uint32_t asleep = scheduler_state.window_sleep / (elapsed / 1000);
+    scheduler_state.duty_cycle = asleep < 1000 ? 1000 - asleep : 0;
+    scheduler_state.window_start += elapsed;
+    scheduler_state.window_sleep = 0;
+}
+
+uint16_t GetSchedulerDutyCycle() {
+    return scheduler_state.duty_cycle;
+}
+
+// Milliseconds since SetupScheduler(), time spent with SysTick stopped is not counted
+uint32_t GetSchedulerMillis() {
+    uint32_t now = SysTick->CNT;
+    scheduler_state.millis_ticks += now - scheduler_state.millis_last;
+    scheduler_state.millis_last = now;
+    uint32_t elapsed = scheduler_state.millis_ticks / DELAY_MS_TIME;
+    scheduler_state.millis += elapsed;
+    scheduler_state.millis_ticks -= elapsed * DELAY_MS_TIME;
+    return scheduler_state.millis;
+}
+
+void SysTick_Handler(void) __attribute__((interrupt));
+void SysTick_Handler(void) {
+    // Only used to wake up from SchedulerSleep()
+    SysTick->CTLR &= ~SYSTICK_CTLR_STIE;
+    SysTick->SR = 0;
+}
+
+#endif
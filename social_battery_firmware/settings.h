@@ -0,0 +1,250 @@
+/*
+ * Single-File-Header for a log-structured settings store in flash
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 Renze Nicolai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Settings are 16-bit values identified by a key. Every change is appended to
+// a log as a four byte record, the last record of a key holds its value:
+//
+//   half-word 0: key (bits 0-7), CRC-8 of key and value (bits 8-15)
+//   half-word 1: value
+//
+// The value is programmed before the key, so a record torn by a power loss
+// never passes its CRC check and is skipped.
+//
+// The log lives in one of two banks. Each bank starts with a header holding a
+// magic number, a sequence number, the number of compactions so far and the
+// value an erased half-word reads as. The bank with a valid header and the
+// highest sequence number is active. When the active bank is full the current
+// value of every key is written to the other bank, after which its header is
+// written to make it the active bank. The header is programmed magic last, so
+// an interrupted compaction leaves the old bank active.
+//
+// At boot only the headers and the used part of the active bank are read.
+
+#ifndef __SETTINGS_H
+#define __SETTINGS_H
+
+#include "flash.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef SETTINGS_KEYS
+#define SETTINGS_KEYS 24 // At most 32
+#endif
+
+#define SETTINGS_BANK_SIZE  (4 * FLASH_PAGE_SIZE) // Bytes
+#define SETTINGS_BANK_WORDS (SETTINGS_BANK_SIZE / 2)
+#define SETTINGS_HEADER     4                     // Half-words
+#define SETTINGS_MAGIC      0x5354
+#define SETTINGS_ENDURANCE  10000                 // Erase cycles of a flash page
+
+// Header half-words, programmed in reverse order
+#define SETTINGS_HEADER_MAGIC    0
+#define SETTINGS_HEADER_SEQUENCE 1
+#define SETTINGS_HEADER_ERASES   2
+#define SETTINGS_HEADER_ERASED   3
+
+const uint16_t settings_flash[2 * SETTINGS_BANK_WORDS] FLASH_STORAGE = {[0 ... (2 * SETTINGS_BANK_WORDS - 1)] = 0xFFFF};
+
+struct _settings_state {
+    uint16_t values[SETTINGS_KEYS];
+    uint32_t stored;   // Bitmask of keys that have a record in flash
+    uint32_t dirty;    // Bitmask of keys changed since they were stored
+    uint8_t bank;
+    uint16_t position; // Half-word offset of the first free record in the active bank
+    uint16_t sequence;
+    uint16_t erases;
+    uint16_t erased;   // Value of an erased half-word
+    uint16_t writes;   // Records written since boot
+} settings_state;
+
+static uint8_t SettingsCrc(uint8_t key, uint16_t value) {
+    uint8_t data[3] = {key, value & 0xFF, value >> 8};
+    uint8_t crc = 0;
+    for (uint8_t i = 0; i < 3; i++) {
+        crc ^= data[i];
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+        }
+    }
+    return crc;
+}
+
+static const volatile uint16_t* SettingsBank(uint8_t bank) {
+    return &settings_flash[bank * SETTINGS_BANK_WORDS];
+}
+
+static bool SettingsBankValid(uint8_t bank) {
+    return SettingsBank(bank)[SETTINGS_HEADER_MAGIC] == SETTINGS_MAGIC;
+}
+
+static void SettingsProgramRecord(uint8_t key, uint16_t value) {
+    uint32_t address = (uint32_t) &SettingsBank(settings_state.bank)[settings_state.position];
+    ProgramFlashHalfWord(address + 2, value);
+    ProgramFlashHalfWord(address, key | (SettingsCrc(key, value) << 8));
+    settings_state.position += 2;
+    settings_state.writes++;
+}
+
+// Erase a bank and make it the active bank, with a copy of every stored value
+static void SettingsCompact() {
+    uint8_t bank = settings_state.bank ^ 1;
+    uint32_t address = (uint32_t) SettingsBank(bank);
+    for (uint16_t offset = 0; offset < SETTINGS_BANK_SIZE; offset += FLASH_PAGE_SIZE) {
+        EraseFlashPage(address + offset);
+    }
+
+    settings_state.bank = bank;
+    settings_state.position = SETTINGS_HEADER;
+    settings_state.sequence++;
+    settings_state.erases++;
+    settings_state.erased = SettingsBank(bank)[SETTINGS_HEADER_ERASED];
+
+    settings_state.stored |= settings_state.dirty;
+    settings_state.dirty = 0;
+    for (uint8_t key = 0; key < SETTINGS_KEYS; key++) {
+        if ((settings_state.stored >> key) & 1) {
+            SettingsProgramRecord(key, settings_state.values[key]);
+        }
+    }
+
+    ProgramFlashHalfWord(address + SETTINGS_HEADER_ERASED * 2, settings_state.erased);
+    ProgramFlashHalfWord(address + SETTINGS_HEADER_ERASES * 2, settings_state.erases);
+    ProgramFlashHalfWord(address + SETTINGS_HEADER_SEQUENCE * 2, settings_state.sequence);
+    ProgramFlashHalfWord(address + SETTINGS_HEADER_MAGIC * 2, SETTINGS_MAGIC);
+}
+
+// Select the active bank and replay its log
+void SetupSettings() {
+    settings_state.stored = 0;
+    settings_state.dirty = 0;
+    settings_state.writes = 0;
+
+    bool valid0 = SettingsBankValid(0);
+    bool valid1 = SettingsBankValid(1);
+    if (!valid0 && !valid1) {
+        // Nothing stored yet, the first save compacts into bank 0
+        settings_state.bank = 1;
+        settings_state.position = SETTINGS_BANK_WORDS;
+        settings_state.sequence = 0;
+        settings_state.erases = 0;
+        return;
+    }
+
+    uint16_t sequence0 = SettingsBank(0)[SETTINGS_HEADER_SEQUENCE];
+    uint16_t sequence1 = SettingsBank(1)[SETTINGS_HEADER_SEQUENCE];
+    settings_state.bank = (!valid0 || (valid1 && (int16_t) (sequence1 - sequence0) > 0)) ? 1 : 0;
+
+    const volatile uint16_t* bank = SettingsBank(settings_state.bank);
+    settings_state.sequence = bank[SETTINGS_HEADER_SEQUENCE];
+    settings_state.erases = bank[SETTINGS_HEADER_ERASES];
+    settings_state.erased = bank[SETTINGS_HEADER_ERASED];
+
+    uint16_t position = SETTINGS_HEADER;
+    for (; position < SETTINGS_BANK_WORDS; position += 2) {
+        uint16_t header = bank[position];
+        uint16_t value = bank[position + 1];
+        if (header == settings_state.erased && value == settings_state.erased) {
+            break; // End of the log
+        }
+        uint8_t key = header & 0xFF;
+        if (key < SETTINGS_KEYS && (header >> 8) == SettingsCrc(key, value)) {
+            settings_state.values[key] = value;
+            settings_state.stored |= 1UL << key;
+        }
+    }
+    settings_state.position = position;
+}
+
+static bool SettingKnown(uint8_t key) {
+    return ((settings_state.stored | settings_state.dirty) >> key) & 1;
+}
+
+// Returns false if the setting has never been set
+bool GetSetting(uint8_t key, uint16_t* value) {
+    if (!SettingKnown(key)) {
+        return false;
+    }
+    *value = settings_state.values[key];
+    return true;
+}
+
+// Change a setting in RAM, returns true if the value differs from the current one
+bool SetSetting(uint8_t key, uint16_t value) {
+    if (SettingKnown(key) && settings_state.values[key] == value) {
+        return false;
+    }
+    settings_state.values[key] = value;
+    settings_state.dirty |= 1UL << key;
+    return true;
+}
+
+bool SettingsDirty() {
+    return settings_state.dirty != 0;
+}
+
+// Append the changed settings to the log
+void SaveSettings() {
+    if (!settings_state.dirty) {
+        return;
+    }
+
+    uint8_t count = 0;
+    for (uint8_t key = 0; key < SETTINGS_KEYS; key++) {
+        count += (settings_state.dirty >> key) & 1;
+    }
+
+    UnlockFlash();
+    if (settings_state.position + count * 2 > SETTINGS_BANK_WORDS) {
+        SettingsCompact();
+    } else {
+        for (uint8_t key = 0; key < SETTINGS_KEYS; key++) {
+            if ((settings_state.dirty >> key) & 1) {
+                SettingsProgramRecord(key, settings_state.values[key]);
+            }
+        }
+        settings_state.stored |= settings_state.dirty;
+        settings_state.dirty = 0;
+    }
+    LockFlash();
+}
+
+// Number of records written since boot
+uint16_t GetSettingsWrites() {
+    return settings_state.writes;
+}
+
+// Number of times the log has been compacted, every bank is erased on every other compaction
+uint16_t GetSettingsErases() {
+    return settings_state.erases;
+}
+
+// Erase cycles left before the flash reaches its rated endurance
+uint16_t GetSettingsEndurance() {
+    uint16_t wear = (settings_state.erases + 1) / 2;
+    return wear < SETTINGS_ENDURANCE ? SETTINGS_ENDURANCE - wear : 0;
+}
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ * Single-File-Header for using a row of touch pads as a slider
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 Renze Nicolai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// The slider position is the centroid of the touch deltas of the strongest pad
+// and its two neighbours, with the pads SLIDER_PAD_PITCH apart. This gives a
+// position between the pads when a finger covers two of them. The velocity is
+// a filtered derivative of the position in position units per second.
+//
+// When the finger is lifted the contact is classified:
+//
+//   - tap: short contact without much movement, a second tap shortly after the
+//     first one is reported as a double tap instead
+//   - swipe: fast movement over a large part of the slider
+//
+// All values are integers, positions are 0-255.
+
+#ifndef __SLIDER_H
+#define __SLIDER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef SLIDER_CHANNELS
+#define SLIDER_CHANNELS 5
+#endif
+
+#define SLIDER_PAD_PITCH         (256 / (SLIDER_CHANNELS - 1))
+#define SLIDER_VELOCITY_FILTER   2   // Filter coefficient 1/4
+
+#define SLIDER_TAP_TIME          250 // ms, maximum contact time of a tap
+#define SLIDER_TAP_DISTANCE      32  // Maximum movement during a tap
+#define SLIDER_DOUBLE_TAP_TIME   350 // ms, maximum time between the end of a tap and the start of the next
+#define SLIDER_SWIPE_TIME        600 // ms, maximum contact time of a swipe
+#define SLIDER_SWIPE_DISTANCE    96  // Minimum movement of a swipe
+
+// Gestures
+#define SLIDER_GESTURE_NONE        0
+#define SLIDER_GESTURE_TAP         1
+#define SLIDER_GESTURE_DOUBLE_TAP  2
+#define SLIDER_GESTURE_SWIPE_LEFT  3 // Towards the first pad
+#define SLIDER_GESTURE_SWIPE_RIGHT 4 // Towards the last pad
+
+struct _slider_state {
+    bool contact;
+    uint8_t position;
+    int16_t velocity;        // Position units per second
+    uint16_t swipe_speed;    // Position units per second of the last swipe
+    uint8_t start_position;
+    uint32_t start_time;     // ms
+    uint32_t last_time;      // ms, time of the last update with contact
+    uint32_t tap_time;       // ms, end of the last tap
+    bool tap_pending;        // The last contact was a tap that can become a double tap
+} slider_state;
+
+void SetupSlider() {
+    slider_state.contact = false;
+    slider_state.position = 0;
+    slider_state.velocity = 0;
+    slider_state.swipe_speed = 0;
+    slider_state.tap_pending = false;
+}
+
+bool GetSliderContact() {
+    return slider_state.contact;
+}
+
+uint8_t GetSliderPosition() {
+    return slider_state.position;
+}
+
+int16_t GetSliderVelocity() {
+    return slider_state.velocity;
+}
+
+uint16_t GetSliderSwipeSpeed() {
+    return slider_state.swipe_speed;
+}
+
+// Centroid of the strongest pressed pad and its neighbours
+static uint8_t SliderCentroid(const int32_t* delta, uint8_t pressed) {
+    uint8_t strongest = 0;
+    for (uint8_t i = 1; i < SLIDER_CHANNELS; i++) {
+        if (((pressed >> i) & 1) && (!((pressed >> strongest) & 1) || delta[i] > delta[strongest])) {
+            strongest = i;
+        }
+    }
+
+    int32_t weight = 0;
+    int32_t moment = 0;
+    for (int8_t i = strongest - 1; i <= strongest + 1; i++) {
+        if (i < 0 || i >= SLIDER_CHANNELS || delta[i] <= 0) {
+            continue;
+        }
+        weight += delta[i];
+        moment += delta[i] * (i * SLIDER_PAD_PITCH);
+    }
+    if (weight == 0) {
+        return strongest * SLIDER_PAD_PITCH;
+    }
+    int32_t position = moment / weight;
+    return position > 255 ? 255 : position;
+}
+
+static uint8_t SliderRelease(uint32_t now) {
+    uint32_t duration = slider_state.last_time - slider_state.start_time;
+    int16_t distance = (int16_t) slider_state.position - (int16_t) slider_state.start_position;
+    uint16_t magnitude = distance < 0 ? -distance : distance;
+
+    if (duration <= SLIDER_SWIPE_TIME && magnitude >= SLIDER_SWIPE_DISTANCE) {
+        uint32_t speed = (uint32_t) magnitude * 1000 / (duration > 0 ? duration : 1);
+        slider_state.swipe_speed = speed > 0xFFFF ? 0xFFFF : speed;
+        slider_state.tap_pending = false;
+        return distance < 0 ? SLIDER_GESTURE_SWIPE_LEFT : SLIDER_GESTURE_SWIPE_RIGHT;
+    }
+
+    if (duration <= SLIDER_TAP_TIME && magnitude <= SLIDER_TAP_DISTANCE) {
+        bool double_tap = slider_state.tap_pending && slider_state.start_time - slider_state.tap_time <= SLIDER_DOUBLE_TAP_TIME;
+        slider_state.tap_pending = !double_tap;
+        slider_state.tap_time = now;
+        return double_tap ? SLIDER_GESTURE_DOUBLE_TAP : SLIDER_GESTURE_TAP;
+    }
+
+    slider_state.tap_pending = false;
+    return SLIDER_GESTURE_NONE;
+}
+
+// Process one scan, now is in milliseconds. Returns the gesture that ended with this scan.
+uint8_t UpdateSlider(const int32_t* delta, uint8_t pressed, uint32_t now) {
+    if (pressed == 0) {
+        if (!slider_state.contact) {
+            return SLIDER_GESTURE_NONE;
+        }
+        slider_state.contact = false;
+        slider_state.velocity = 0;
+        return SliderRelease(now);
+    }
+
+    uint8_t position = SliderCentroid(delta, pressed);
+
+    if (!slider_state.contact) {
+        slider_state.contact = true;
+        slider_state.start_position = position;
+        slider_state.start_time = now;
+        slider_state.velocity = 0;
+    } else if (now != slider_state.last_time) {
+        int32_t velocity = ((int32_t) position - slider_state.position) * 1000 / (int32_t) (now - slider_state.last_time);
+        int32_t filtered = slider_state.velocity + ((velocity - slider_state.velocity) >> SLIDER_VELOCITY_FILTER);
+        slider_state.velocity = filtered > INT16_MAX ? INT16_MAX : (filtered < INT16_MIN ? INT16_MIN : filtered);
+    }
+
+    slider_state.position = position;
+    slider_state.last_time = now;
+    return SLIDER_GESTURE_NONE;
+}
+
+#endif
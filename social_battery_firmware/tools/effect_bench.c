@@ -0,0 +1,141 @@
+/*
+ * Host benchmark for the LED effects, see effects.h
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 Renze Nicolai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Usage: effect_bench [-f frames] [-p period] [slot.bin]
+//
+// Runs every effect in the effects table for a number of frames with a touch
+// pattern that presses each pad in turn and drags along the slider, and prints
+// the time per frame, touch scan included, and per touch scan on the host. The
+// numbers are only useful relative to each other, the task statistics registers
+// give the cycles on the badge. slot.bin is loaded as the uploaded animation or
+// effect program, for example the output of effect_vm -o.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "host_shim.h"
+#include "../effects.h"
+
+#define SLOT_SIZE 128 // Bytes of the EEPROM used for uploads
+
+static uint64_t nanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Every 25 frames the next pad is pressed, with a drag along the slider in between
+static void fill_context(effect_context_t* context, int frame, int period, uint8_t* leds) {
+    int phase = (frame / 25) % 7;
+    context->now = frame * period;
+    context->touch = phase < EFFECT_LEDS ? 1 << phase : 0;
+    context->slider_contact = phase == EFFECT_LEDS;
+    context->slider_position = context->slider_contact ? (frame % 25) * 10 : 0;
+    context->gesture = (frame % 175) == 174 ? SLIDER_GESTURE_DOUBLE_TAP : SLIDER_GESTURE_NONE;
+    context->social_level = (frame / 25) % EFFECT_LEDS;
+    context->leds = leds;
+}
+
+// Run an effect from its start, returns the time in nanoseconds
+static uint64_t run(const effect_t* effect, effect_context_t* contexts, int frames, bool step, uint8_t* slot) {
+    SetupEffects();
+    SetupAnimation(slot, SLOT_SIZE);
+    SetupEffectVm(slot, SLOT_SIZE);
+    StartEffect(effect, &contexts[0]);
+
+    uint64_t start = nanoseconds();
+    for (int frame = 0; frame < frames; frame++) {
+        if (effect->on_touch) {
+            effect->on_touch(effect, &contexts[frame]);
+        }
+        if (step) {
+            effect->step(effect, &contexts[frame]);
+        }
+    }
+    return nanoseconds() - start;
+}
+
+int main(int argc, char** argv) {
+    int frames = 100000;
+    int period = 20;
+    const char* slot_file = NULL;
+
+    for (int arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "-f") == 0 && arg + 1 < argc) {
+            frames = atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "-p") == 0 && arg + 1 < argc) {
+            period = atoi(argv[++arg]);
+        } else if (argv[arg][0] != '-' && !slot_file) {
+            slot_file = argv[arg];
+        } else {
+            fprintf(stderr, "usage: %s [-f frames] [-p period] [slot.bin]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (frames <= 0) {
+        fprintf(stderr, "frames must be positive\n");
+        return 1;
+    }
+
+    uint8_t slot[SLOT_SIZE] = {0};
+    if (slot_file) {
+        FILE* file = fopen(slot_file, "rb");
+        if (!file) {
+            perror(slot_file);
+            return 1;
+        }
+        size_t size = fread(slot, 1, sizeof(slot), file);
+        fclose(file);
+        printf("%s: %zu bytes\n", slot_file, size);
+    }
+
+    // The inputs are prepared up front so only the effects are timed
+    uint8_t leds[EFFECT_LEDS * 3] = {0};
+    effect_context_t* contexts = malloc(frames * sizeof(effect_context_t));
+    if (!contexts) {
+        perror("malloc");
+        return 1;
+    }
+    for (int frame = 0; frame < frames; frame++) {
+        fill_context(&contexts[frame], frame, period, leds);
+    }
+
+    printf("mode flags  ns/frame  ns/touch\n");
+    for (uint8_t i = 0; i < NUM_EFFECTS; i++) {
+        const effect_t* effect = &effects[i];
+        memset(leds, 0, sizeof(leds));
+        uint64_t frame_time = run(effect, contexts, frames, true, slot);
+        uint64_t touch_time = effect->on_touch ? run(effect, contexts, frames, false, slot) : 0;
+        printf("%4u  0x%02X  %8.1f  %8.1f\n", effect->mode, effect->flags,
+               (double) frame_time / frames, (double) touch_time / frames);
+    }
+    free(contexts);
+    return 0;
+}
@@ -0,0 +1,344 @@
+/*
+ * Assembler and simulator for LED effect bytecode, see effect_vm.h
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 Renze Nicolai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Usage: effect_vm [options] program.evm
+//
+//   -o file       Write the program, header included, to file
+//   -f frames     Number of frames to simulate (50)
+//   -p period     Frame period in milliseconds (20)
+//   -t frame:pads From this frame on the touch pads in the bitmask are pressed
+//   -s frame:pos  From this frame on the slider is touched at pos, -1 releases it
+//   -l level      Social level (0)
+//   -m size       Size of the program slot in bytes (128)
+//   -q            Only print the summary
+//
+// Source format, one instruction per line:
+//
+//   ; comment
+//   label:
+//       push 200        ; numbers are decimal, or hexadecimal with 0x
+//       in time         ; inputs by name, see effect_vm_inputs
+//       jz label        ; jump targets by label
+//
+// push picks the 16-bit form for values that do not fit in 8 bits. The
+// simulator fails if any frame stops with an error.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "host_shim.h"
+#define EFFECT_VM_NAMES
+#include "../effect_vm.h"
+
+#define MAX_PROGRAM 255
+#define MAX_LABELS  64
+#define MAX_EVENTS  64
+
+typedef struct {
+    char name[32];
+    int address;
+} label_t;
+
+typedef struct {
+    int frame;
+    int value;
+} event_t;
+
+static label_t labels[MAX_LABELS];
+static int label_count = 0;
+
+static const char* source_name;
+static int source_line;
+
+static void fail(const char* message, const char* token) {
+    fprintf(stderr, "%s:%d: %s%s%s\n", source_name, source_line, message, token ? ": " : "", token ? token : "");
+    exit(1);
+}
+
+static bool parse_number(const char* token, long* value) {
+    char* end;
+    *value = strtol(token, &end, 0);
+    return *token != '\0' && *end == '\0';
+}
+
+static int find_label(const char* name) {
+    for (int i = 0; i < label_count; i++) {
+        if (strcmp(labels[i].name, name) == 0) {
+            return labels[i].address;
+        }
+    }
+    return -1;
+}
+
+static int find_opcode(const char* name) {
+    for (int op = 0; op < EFFECT_VM_NUM_OPS; op++) {
+        if (strcmp(effect_vm_names[op], name) == 0) {
+            return op;
+        }
+    }
+    return -1;
+}
+
+// Split a line into a label, a mnemonic and an operand, all optional
+static void split_line(char* line, char** label, char** mnemonic, char** operand) {
+    char* comment = strchr(line, ';');
+    if (comment) {
+        *comment = '\0';
+    }
+    *label = NULL;
+    char* colon = strchr(line, ':');
+    if (colon) {
+        *colon = '\0';
+        *label = strtok(line, " \t\r\n");
+        if (!*label) {
+            fail("empty label", NULL);
+        }
+        line = colon + 1;
+    }
+    *mnemonic = strtok(line, " \t\r\n");
+    *operand = *mnemonic ? strtok(NULL, " \t\r\n") : NULL;
+    if (*operand && strtok(NULL, " \t\r\n")) {
+        fail("too many operands", *mnemonic);
+    }
+}
+
+// Opcode and size of an instruction, push becomes push16 when the value needs it
+static int instruction(const char* mnemonic, const char* operand, int* op) {
+    *op = find_opcode(mnemonic);
+    if (*op < 0) {
+        fail("unknown instruction", mnemonic);
+    }
+    if ((EFFECT_VM_OPERAND(*op) > 0) != (operand != NULL)) {
+        fail(operand ? "unexpected operand" : "missing operand", mnemonic);
+    }
+    long value;
+    if (*op == EFFECT_VM_OP_PUSH && parse_number(operand, &value) && (value < -128 || value > 127)) {
+        *op = EFFECT_VM_OP_PUSH16;
+    }
+    return 1 + EFFECT_VM_OPERAND(*op);
+}
+
+static long operand_value(int op, const char* operand, int next) {
+    long value;
+    if (op == EFFECT_VM_OP_JMP || op == EFFECT_VM_OP_JZ) {
+        int address = find_label(operand);
+        if (address >= 0) {
+            value = address - next;
+        } else if (!parse_number(operand, &value)) {
+            fail("unknown label", operand);
+        }
+    } else if (op == EFFECT_VM_OP_IN) {
+        for (value = 0; value < EFFECT_VM_INPUTS && strcmp(effect_vm_inputs[value], operand) != 0; value++);
+        if (value == EFFECT_VM_INPUTS && (!parse_number(operand, &value) || value < 0 || value >= EFFECT_VM_INPUTS)) {
+            fail("unknown input", operand);
+        }
+    } else if (!parse_number(operand, &value)) {
+        fail("invalid number", operand);
+    }
+    if ((op == EFFECT_VM_OP_LOAD || op == EFFECT_VM_OP_STORE) && (value < 0 || value >= EFFECT_VM_VARS)) {
+        fail("invalid variable", operand);
+    }
+    if (op == EFFECT_VM_OP_PUSH16 ? (value < -32768 || value > 65535) : (value < -128 || value > 127)) {
+        fail("operand out of range", operand);
+    }
+    return value;
+}
+
+// Two passes, the first one collects the labels
+static int assemble(FILE* file, uint8_t* program) {
+    char line[256];
+    int length = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        rewind(file);
+        source_line = 0;
+        length = 0;
+        while (fgets(line, sizeof(line), file)) {
+            source_line++;
+            char *label, *mnemonic, *operand;
+            split_line(line, &label, &mnemonic, &operand);
+            if (label && pass == 0) {
+                if (find_label(label) >= 0 || label_count >= MAX_LABELS || strlen(label) >= sizeof(labels[0].name)) {
+                    fail("invalid or duplicate label", label);
+                }
+                strcpy(labels[label_count].name, label);
+                labels[label_count++].address = length;
+            }
+            if (!mnemonic) {
+                continue;
+            }
+            int op;
+            int size = instruction(mnemonic, operand, &op);
+            if (length + size > MAX_PROGRAM) {
+                fail("program too long", NULL);
+            }
+            if (pass == 1) {
+                uint8_t* code = &program[EFFECT_VM_HEADER_SIZE + length];
+                code[0] = op;
+                if (size > 1) {
+                    long value = operand_value(op, operand, length + size);
+                    code[1] = value & 0xFF;
+                    if (size > 2) {
+                        code[2] = (value >> 8) & 0xFF;
+                    }
+                }
+            }
+            length += size;
+        }
+    }
+    program[0] = EFFECT_VM_MAGIC;
+    program[1] = length;
+    return EFFECT_VM_HEADER_SIZE + length;
+}
+
+static void parse_event(const char* argument, event_t* events, int* count) {
+    char* end;
+    if (*count >= MAX_EVENTS) {
+        fprintf(stderr, "too many events\n");
+        exit(1);
+    }
+    events[*count].frame = strtol(argument, &end, 0);
+    if (*end != ':') {
+        fprintf(stderr, "invalid event: %s, expected frame:value\n", argument);
+        exit(1);
+    }
+    events[*count].value = strtol(end + 1, NULL, 0);
+    (*count)++;
+}
+
+// Value of the last event at or before frame, or initial
+static int event_value(const event_t* events, int count, int frame, int initial) {
+    int value = initial;
+    int latest = -1;
+    for (int i = 0; i < count; i++) {
+        if (events[i].frame <= frame && events[i].frame >= latest) {
+            latest = events[i].frame;
+            value = events[i].value;
+        }
+    }
+    return value;
+}
+
+int main(int argc, char** argv) {
+    const char* output = NULL;
+    int frames = 50;
+    int period = 20;
+    int social = 0;
+    int slot = 128;
+    bool quiet = false;
+    event_t touch[MAX_EVENTS], slider[MAX_EVENTS];
+    int touch_count = 0, slider_count = 0;
+
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-' && argv[arg][1] != '\0'; arg++) {
+        char option = argv[arg][1];
+        if (option == 'q') {
+            quiet = true;
+            continue;
+        }
+        if (arg + 1 >= argc) {
+            fprintf(stderr, "missing value for -%c\n", option);
+            return 1;
+        }
+        const char* value = argv[++arg];
+        switch (option) {
+            case 'o': output = value; break;
+            case 'f': frames = atoi(value); break;
+            case 'p': period = atoi(value); break;
+            case 'l': social = atoi(value); break;
+            case 'm': slot = atoi(value); break;
+            case 't': parse_event(value, touch, &touch_count); break;
+            case 's': parse_event(value, slider, &slider_count); break;
+            default:
+                fprintf(stderr, "unknown option -%c\n", option);
+                return 1;
+        }
+    }
+    if (arg != argc - 1) {
+        fprintf(stderr, "usage: %s [-o file] [-f frames] [-p period] [-t frame:pads] [-s frame:pos] [-l level] [-m size] [-q] program.evm\n", argv[0]);
+        return 1;
+    }
+
+    source_name = argv[arg];
+    FILE* file = fopen(source_name, "r");
+    if (!file) {
+        perror(source_name);
+        return 1;
+    }
+    uint8_t program[EFFECT_VM_HEADER_SIZE + MAX_PROGRAM] = {0};
+    int size = assemble(file, program);
+    fclose(file);
+
+    if (size > slot) {
+        fprintf(stderr, "%s: %d bytes do not fit in the %d byte slot\n", source_name, size, slot);
+        return 1;
+    }
+    if (output) {
+        FILE* out = fopen(output, "wb");
+        if (!out || fwrite(program, 1, size, out) != (size_t) size || fclose(out) != 0) {
+            perror(output);
+            return 1;
+        }
+    }
+
+    SetupEffectVm(program, size);
+    uint32_t colors[EFFECT_VM_LEDS] = {0};
+    uint32_t total_steps = 0;
+    uint16_t max_steps = 0;
+    int errors = 0;
+    for (int frame = 0; frame < frames; frame++) {
+        int position = event_value(slider, slider_count, frame, -1);
+        SetEffectVmInput(EFFECT_VM_IN_TIME, frame * period);
+        SetEffectVmInput(EFFECT_VM_IN_TOUCH, event_value(touch, touch_count, frame, 0));
+        SetEffectVmInput(EFFECT_VM_IN_SLIDER, position < 0 ? 0 : position);
+        SetEffectVmInput(EFFECT_VM_IN_CONTACT, position >= 0);
+        SetEffectVmInput(EFFECT_VM_IN_SOCIAL, social);
+
+        uint8_t error = RunEffectVm(colors);
+        uint16_t steps = GetEffectVmSteps();
+        total_steps += steps;
+        if (steps > max_steps) {
+            max_steps = steps;
+        }
+        if (error != EFFECT_VM_OK) {
+            errors++;
+        }
+        if (!quiet || error != EFFECT_VM_OK) {
+            printf("%5d %4u", frame, steps);
+            for (int led = 0; led < EFFECT_VM_LEDS; led++) {
+                printf(" %06X", colors[led]);
+            }
+            printf(error != EFFECT_VM_OK ? " error %u\n" : "\n", error);
+        }
+    }
+
+    printf("%s: %d bytes, %d frames, %u instructions per frame on average, at most %u of %u, %d errors\n",
+           source_name, size, frames, frames > 0 ? total_steps / frames : 0, max_steps, EFFECT_VM_BUDGET, errors);
+    return errors > 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * Host test for the SPI LED symbol encoder, see led_spi_encoder.h
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 Renze Nicolai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Usage: led_spi_test
+//
+// Checks the symbols sent for sample bytes, their high times, and the stream
+// the DMA sends when the frame is encoded chunk by chunk into the two halves
+// of the buffer, for every frame length. Exits non-zero on a failure.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../led_spi_encoder.h"
+
+#define MAX_BYTES    15                   // LED_SPI_MAX_BYTES, five LEDs
+#define SPI_CLOCK_HZ 3000000
+#define T0H_NS       333                  // Datasheet T0H 220-380 ns for the SK6812, 200-500 ns for the WS2812
+#define T1H_NS       667                  // Datasheet T1H 580-1000 ns for the SK6812, 550-850 ns for the WS2812
+#define MAX_STREAM   (MAX_BYTES * 4 + 2 * LED_SPI_HALF_SIZE * 2)
+
+static int failures = 0;
+
+#define CHECK(condition, ...) do { \
+    if (!(condition)) { \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        failures++; \
+    } \
+} while (0)
+
+// Bit of the SPI stream, MSB first
+static int stream_bit(const uint8_t* stream, int bit) {
+    return (stream[bit / 8] >> (7 - (bit % 8))) & 1;
+}
+
+// Decode the 4-bit symbol of one LED bit, returns the LED bit or -1 for an invalid symbol
+static int decode_symbol(const uint8_t* stream, int symbol, int* high_ns) {
+    int bits = 0;
+    for (int i = 0; i < 4; i++) {
+        bits = (bits << 1) | stream_bit(stream, symbol * 4 + i);
+    }
+    int high_bits = bits == 0x8 ? 1 : bits == 0xC ? 2 : 0;
+    *high_ns = (high_bits * 1000000000LL + SPI_CLOCK_HZ / 2) / SPI_CLOCK_HZ;
+    return bits == 0x8 ? 0 : bits == 0xC ? 1 : -1;
+}
+
+static void test_symbols() {
+    static const uint8_t samples[] = {0x00, 0xFF, 0x80, 0x01, 0xA5, 0x5A, 0x3C, 0xC3};
+    for (unsigned i = 0; i < sizeof(samples); i++) {
+        uint8_t out[4];
+        LedSpiEncode(&samples[i], 1, out);
+        for (int bit = 0; bit < 8; bit++) {
+            int expected = (samples[i] >> (7 - bit)) & 1;
+            int high_ns;
+            int decoded = decode_symbol(out, bit, &high_ns);
+            CHECK(decoded == expected, "byte 0x%02X bit %d: symbol %d, expected %d", samples[i], bit, decoded, expected);
+            CHECK(high_ns == (expected ? T1H_NS : T0H_NS), "byte 0x%02X bit %d: high for %d ns", samples[i], bit, high_ns);
+        }
+    }
+
+    // Every symbol ends low, so the line is low between the last bit and the latch
+    uint8_t ones = 0xFF, out[4];
+    LedSpiEncode(&ones, 1, out);
+    CHECK(stream_bit(out, 31) == 0, "last bit of a frame is high");
+}
+
+// Run the ping-pong refill the way the DMA interrupt handler does and collect
+// everything the DMA sends until it stops after an idle half
+static int run_transfer(const uint8_t* frame, uint8_t length, uint8_t* stream, int* refills) {
+    uint8_t buffer[LED_SPI_HALF_SIZE * 2];
+    bool half_idle[2];
+    uint8_t position = 0;
+    int sent = 0;
+
+    half_idle[0] = LedSpiEncodeChunk(frame, length, &position, &buffer[0]);
+    half_idle[1] = LedSpiEncodeChunk(frame, length, &position, &buffer[LED_SPI_HALF_SIZE]);
+    *refills = 0;
+    for (uint8_t half = 0; sent + LED_SPI_HALF_SIZE <= MAX_STREAM; half ^= 1) {
+        memcpy(&stream[sent], &buffer[half * LED_SPI_HALF_SIZE], LED_SPI_HALF_SIZE);
+        sent += LED_SPI_HALF_SIZE;
+        if (half_idle[half]) {
+            break;
+        }
+        uint8_t before = position;
+        half_idle[half] = LedSpiEncodeChunk(frame, length, &position, &buffer[half * LED_SPI_HALF_SIZE]);
+        CHECK(position - before == (length - before > LED_SPI_CHUNK_BYTES ? LED_SPI_CHUNK_BYTES : length - before),
+              "length %u: chunk at %u advanced by %u", length, before, position - before);
+        (*refills)++;
+    }
+    return sent;
+}
+
+static void test_chunks() {
+    uint8_t frame[MAX_BYTES];
+    for (int i = 0; i < MAX_BYTES; i++) {
+        frame[i] = (uint8_t) (0x5A + i * 37);
+    }
+
+    for (uint8_t length = 0; length <= MAX_BYTES; length++) {
+        uint8_t stream[MAX_STREAM];
+        uint8_t expected[MAX_BYTES * 4];
+        int refills;
+        int sent = run_transfer(frame, length, stream, &refills);
+        LedSpiEncode(frame, length, expected);
+
+        // The chunks join up to the frame encoded in one go
+        CHECK(sent >= length * 4, "length %u: only %d bytes sent", length, sent);
+        CHECK(memcmp(stream, expected, length * 4) == 0, "length %u: stream differs from the encoded frame", length);
+
+        // Followed by idle padding up to the end, at least one full idle half
+        int padding = sent - length * 4;
+        for (int i = length * 4; i < sent; i++) {
+            CHECK(stream[i] == 0, "length %u: padding byte %d is 0x%02X", length, i, stream[i]);
+        }
+        CHECK(padding >= LED_SPI_HALF_SIZE, "length %u: %d bytes of padding", length, padding);
+        CHECK(sent % LED_SPI_HALF_SIZE == 0, "length %u: stopped halfway a half", length);
+
+        // The transfer ends with the first idle half, with a data half or a padded half in front of it
+        int data_halves = (length + LED_SPI_CHUNK_BYTES - 1) / LED_SPI_CHUNK_BYTES;
+        CHECK(sent == (data_halves + 1) * LED_SPI_HALF_SIZE, "length %u: %d bytes sent for %d chunks", length, sent, data_halves);
+        CHECK(refills == data_halves, "length %u: %d refills", length, refills);
+    }
+}
+
+int main() {
+    test_symbols();
+    test_chunks();
+
+    printf("chunk of %d bytes, %lld us to refill a half\n", LED_SPI_CHUNK_BYTES, LED_SPI_HALF_SIZE * 8 * 1000000LL / SPI_CLOCK_HZ);
+    if (failures > 0) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("all passed\n");
+    return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * Host test for the LED timer compare value encoder, see led_timer_encoder.h
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 Renze Nicolai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Usage: led_timer_test
+//
+// Checks the high time of the compare values for sample bytes against the LED
+// datasheets, and the stream the DMA loads when the frame is encoded chunk by
+// chunk into the two halves of the buffer, for every frame length. Exits
+// non-zero on a failure.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define FUNCONF_SYSTEM_CORE_CLOCK 48000000
+#include "../led_timer_encoder.h"
+
+#define MAX_BYTES  15 // LED_TIMER_MAX_BYTES, five LEDs
+#define T0H_MIN_NS 220 // Datasheet T0H 220-380 ns for the SK6812, 200-500 ns for the WS2812
+#define T0H_MAX_NS 380
+#define T1H_MIN_NS 580 // Datasheet T1H 580-1000 ns for the SK6812, 550-850 ns for the WS2812
+#define T1H_MAX_NS 850
+#define MAX_STREAM (MAX_BYTES * 8 + 2 * LED_TIMER_HALF_SIZE * 2)
+
+static int failures = 0;
+
+#define CHECK(condition, ...) do { \
+    if (!(condition)) { \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        failures++; \
+    } \
+} while (0)
+
+static int high_ns(uint8_t compare) {
+    return (compare * 1000000000LL + FUNCONF_SYSTEM_CORE_CLOCK / 2) / FUNCONF_SYSTEM_CORE_CLOCK;
+}
+
+static void test_compare_values() {
+    static const uint8_t samples[] = {0x00, 0xFF, 0x80, 0x01, 0xA5, 0x5A, 0x3C, 0xC3};
+    for (unsigned i = 0; i < sizeof(samples); i++) {
+        uint8_t out[8];
+        LedTimerEncode(&samples[i], 1, out);
+        for (int bit = 0; bit < 8; bit++) {
+            int expected = (samples[i] >> (7 - bit)) & 1;
+            CHECK(out[bit] == (expected ? LED_TIMER_T1H : LED_TIMER_T0H), "byte 0x%02X bit %d: compare value %u", samples[i], bit, out[bit]);
+        }
+    }
+
+    CHECK(high_ns(LED_TIMER_T0H) >= T0H_MIN_NS && high_ns(LED_TIMER_T0H) <= T0H_MAX_NS, "0 bit high for %d ns", high_ns(LED_TIMER_T0H));
+    CHECK(high_ns(LED_TIMER_T1H) >= T1H_MIN_NS && high_ns(LED_TIMER_T1H) <= T1H_MAX_NS, "1 bit high for %d ns", high_ns(LED_TIMER_T1H));
+    CHECK(LED_TIMER_T1H < LED_TIMER_PERIOD, "1 bit does not end low");
+}
+
+// Run the ping-pong refill the way the DMA interrupt handler does and collect
+// everything the DMA loads until it stops after an idle half
+static int run_transfer(const uint8_t* frame, uint8_t length, uint8_t* stream, int* refills) {
+    uint8_t buffer[LED_TIMER_HALF_SIZE * 2];
+    bool half_idle[2];
+    uint8_t position = 0;
+    int sent = 0;
+
+    half_idle[0] = LedTimerEncodeChunk(frame, length, &position, &buffer[0]);
+    half_idle[1] = LedTimerEncodeChunk(frame, length, &position, &buffer[LED_TIMER_HALF_SIZE]);
+    *refills = 0;
+    for (uint8_t half = 0; sent + LED_TIMER_HALF_SIZE <= MAX_STREAM; half ^= 1) {
+        memcpy(&stream[sent], &buffer[half * LED_TIMER_HALF_SIZE], LED_TIMER_HALF_SIZE);
+        sent += LED_TIMER_HALF_SIZE;
+        if (half_idle[half]) {
+            break;
+        }
+        uint8_t before = position;
+        half_idle[half] = LedTimerEncodeChunk(frame, length, &position, &buffer[half * LED_TIMER_HALF_SIZE]);
+        CHECK(position - before == (length - before > LED_TIMER_CHUNK_BYTES ? LED_TIMER_CHUNK_BYTES : length - before),
+              "length %u: chunk at %u advanced by %u", length, before, position - before);
+        (*refills)++;
+    }
+    return sent;
+}
+
+static void test_chunks() {
+    uint8_t frame[MAX_BYTES];
+    for (int i = 0; i < MAX_BYTES; i++) {
+        frame[i] = (uint8_t) (0x5A + i * 37);
+    }
+
+    for (uint8_t length = 0; length <= MAX_BYTES; length++) {
+        uint8_t stream[MAX_STREAM];
+        uint8_t expected[MAX_BYTES * 8];
+        int refills;
+        int sent = run_transfer(frame, length, stream, &refills);
+        LedTimerEncode(frame, length, expected);
+
+        // The chunks join up to the frame encoded in one go
+        CHECK(sent >= length * 8, "length %u: only %d values loaded", length, sent);
+        CHECK(memcmp(stream, expected, length * 8) == 0, "length %u: stream differs from the encoded frame", length);
+
+        // Followed by idle periods up to the end, at least one full idle half
+        int padding = sent - length * 8;
+        for (int i = length * 8; i < sent; i++) {
+            CHECK(stream[i] == 0, "length %u: padding value %d is %u", length, i, stream[i]);
+        }
+        CHECK(padding >= LED_TIMER_HALF_SIZE, "length %u: %d idle periods", length, padding);
+        CHECK(sent % LED_TIMER_HALF_SIZE == 0, "length %u: stopped halfway a half", length);
+
+        // The transfer ends with the first idle half, with a data half or a padded half in front of it
+        int data_halves = (length + LED_TIMER_CHUNK_BYTES - 1) / LED_TIMER_CHUNK_BYTES;
+        CHECK(sent == (data_halves + 1) * LED_TIMER_HALF_SIZE, "length %u: %d values loaded for %d chunks", length, sent, data_halves);
+        CHECK(refills == data_halves, "length %u: %d refills", length, refills);
+    }
+}
+
+int main() {
+    test_compare_values();
+    test_chunks();
+
+    printf("chunk of %d bytes, %d us to refill a half\n", LED_TIMER_CHUNK_BYTES, LED_TIMER_HALF_SIZE * 1250 / 1000);
+    if (failures > 0) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("all passed\n");
+    return 0;
+}
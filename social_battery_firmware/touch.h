@@ -0,0 +1,171 @@
+/*
+ * Single-File-Header for processing capacitive touch readings
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 Renze Nicolai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Baseline tracking
+//
+// Every channel has a baseline that follows the untouched reading through a slow
+// IIR filter, so humidity and temperature drift do not end up as touches. While
+// a pad is active the baseline is frozen. A reading below the baseline can only
+// mean the baseline is too high (for example because the pad was touched at
+// power-on), so in that direction the filter converges a lot faster. A pad that
+// stays active for longer than TOUCH_BASELINE_MAX_ACTIVE samples is assumed to be
+// stuck and its baseline is reset to the current reading.
+//
+// Touch state
+//
+// A pad becomes pressed when its delta exceeds the press threshold and released
+// when it drops below the (lower) release threshold. A change of state is only
+// accepted after it has been seen in debounce consecutive scans. The result is
+// a bitmask of pressed pads, computed once per scan by UpdateTouch().
+
+#ifndef __TOUCH_H
+#define __TOUCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef TOUCH_CHANNELS
+#define TOUCH_CHANNELS 5
+#endif
+
+#define TOUCH_BASELINE_FRACTION   4    // Fractional bits of the baseline
+#define TOUCH_BASELINE_RATE       8    // Filter coefficient 1/256 while drifting up
+#define TOUCH_BASELINE_FAST_RATE  3    // Filter coefficient 1/8 while below the baseline
+#define TOUCH_BASELINE_MAX_ACTIVE 1500 // Samples
+
+#define TOUCH_DEFAULT_PRESS       1900
+#define TOUCH_DEFAULT_RELEASE     1500
+#define TOUCH_DEFAULT_DEBOUNCE    2    // Scans
+
+struct _touch_state {
+    uint32_t baseline[TOUCH_CHANNELS]; // Fixed point with TOUCH_BASELINE_FRACTION fractional bits
+    uint16_t active_samples[TOUCH_CHANNELS];
+    uint16_t press_threshold[TOUCH_CHANNELS];
+    uint16_t release_threshold[TOUCH_CHANNELS];
+    uint8_t debounce;
+    uint8_t debounce_count[TOUCH_CHANNELS];
+    uint8_t pressed; // Bitmask
+} touch_state;
+
+void SetupTouchBaseline(const uint32_t* raw) {
+    for (uint8_t i = 0; i < TOUCH_CHANNELS; i++) {
+        touch_state.baseline[i] = raw[i] << TOUCH_BASELINE_FRACTION;
+        touch_state.active_samples[i] = 0;
+    }
+}
+
+void SetupTouch(const uint32_t* raw) {
+    SetupTouchBaseline(raw);
+    for (uint8_t i = 0; i < TOUCH_CHANNELS; i++) {
+        touch_state.press_threshold[i] = TOUCH_DEFAULT_PRESS;
+        touch_state.release_threshold[i] = TOUCH_DEFAULT_RELEASE;
+        touch_state.debounce_count[i] = 0;
+    }
+    touch_state.debounce = TOUCH_DEFAULT_DEBOUNCE;
+    touch_state.pressed = 0;
+}
+
+// The release threshold is clamped to the press threshold, so there is always a valid hysteresis band
+void SetTouchThresholds(uint8_t channel, uint16_t press, uint16_t release) {
+    touch_state.press_threshold[channel] = press;
+    touch_state.release_threshold[channel] = release < press ? release : press;
+}
+
+void SetTouchDebounce(uint8_t debounce) {
+    touch_state.debounce = debounce;
+}
+
+uint8_t GetTouchPressed() {
+    return touch_state.pressed;
+}
+
+bool IsTouchPressed(uint8_t channel) {
+    return (touch_state.pressed >> channel) & 1;
+}
+
+void SetTouchBaseline(uint8_t channel, uint32_t value) {
+    touch_state.baseline[channel] = value << TOUCH_BASELINE_FRACTION;
+}
+
+uint32_t GetTouchBaseline(uint8_t channel) {
+    return touch_state.baseline[channel] >> TOUCH_BASELINE_FRACTION;
+}
+
+// Bitmask of channels for which the baseline is currently frozen
+uint8_t GetTouchBaselineFrozen() {
+    uint8_t frozen = 0;
+    for (uint8_t i = 0; i < TOUCH_CHANNELS; i++) {
+        if (touch_state.active_samples[i] > 0) {
+            frozen |= 1 << i;
+        }
+    }
+    return frozen;
+}
+
+// Difference between a reading and the baseline, positive when touched
+int32_t GetTouchDelta(uint8_t channel, uint32_t raw) {
+    return (int32_t) raw - (int32_t) GetTouchBaseline(channel);
+}
+
+// Feed a new reading into the baseline filter, active tells whether the pad is touched
+void UpdateTouchBaseline(uint8_t channel, uint32_t raw, bool active) {
+    int32_t target = raw << TOUCH_BASELINE_FRACTION;
+    int32_t error = target - (int32_t) touch_state.baseline[channel];
+
+    if (active) {
+        if (touch_state.active_samples[channel] < TOUCH_BASELINE_MAX_ACTIVE) {
+            touch_state.active_samples[channel]++;
+            return;
+        }
+        touch_state.baseline[channel] = target; // Stuck, recalibrate
+    } else if (error < 0) {
+        touch_state.baseline[channel] += error >> TOUCH_BASELINE_FAST_RATE;
+    } else {
+        touch_state.baseline[channel] += error >> TOUCH_BASELINE_RATE;
+    }
+    touch_state.active_samples[channel] = 0;
+}
+
+// Process one scan of raw readings, stores the difference with the baseline of every channel in delta
+void UpdateTouch(const uint32_t* raw, int32_t* delta) {
+    for (uint8_t i = 0; i < TOUCH_CHANNELS; i++) {
+        delta[i] = GetTouchDelta(i, raw[i]);
+
+        bool pressed = IsTouchPressed(i);
+        bool above = delta[i] > (int32_t) (pressed ? touch_state.release_threshold[i] : touch_state.press_threshold[i]);
+        if (above == pressed) {
+            touch_state.debounce_count[i] = 0;
+        } else if (++touch_state.debounce_count[i] >= touch_state.debounce) {
+            touch_state.debounce_count[i] = 0;
+            touch_state.pressed ^= 1 << i;
+        }
+
+        // Anything over the release threshold counts as touched for the baseline
+        UpdateTouchBaseline(i, raw[i], delta[i] > (int32_t) touch_state.release_threshold[i]);
+    }
+}
+
+#endif
@@ -0,0 +1,237 @@
+/*
+ * Single-File-Header for scanning capacitive touch pads in the background
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 Renze Nicolai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Uses the same measurement as ReadTouchPin() from ch32v003_touch.h: a pad is
+// driven high, then released into its pull-down right after the ADC has started
+// sampling it, so the conversion catches the discharge slope. A larger pad
+// capacitance (a finger) gives a slower slope and a higher reading.
+//
+// Because every conversion has to start at the moment its pad is released, the
+// channels can not be converted as a free running scan group. Instead the ADC end
+// of conversion interrupt collects the result, charges the pad again and starts
+// the next channel. The channels are interleaved, so every pad has a full round
+// of conversions to charge. The start delay is varied between rounds to spread
+// the readings over several points of the slope, which reduces the effect of the
+// ADC differential non-linearity.
+//
+// This costs one interrupt per conversion, TOUCH_SCAN_SAMPLES rounds of one per
+// channel, 320 for five pads. The CPU is free between them while the ADC samples
+// and converts. GetTouchScanIsrTime() returns the time the last scan spent in the
+// interrupt handler, so the share of the CPU it takes can be checked on the badge.
+//
+// After TOUCH_SCAN_SAMPLES rounds the sums are scaled to TOUCH_SCAN_SCALE samples,
+// so results are comparable to ReadTouchPin() with TOUCH_SCAN_SCALE / 3 iterations.
+//
+// InitTouchADC() has to be called before SetupTouchScan(). ReadTouchPin() can
+// not be used anymore once the end of conversion interrupt is enabled.
+
+#ifndef __TOUCH_SCAN_H
+#define __TOUCH_SCAN_H
+
+#include "ch32v003fun.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef TOUCH_SCAN_MAX_CHANNELS
+#define TOUCH_SCAN_MAX_CHANNELS 5
+#endif
+
+#ifndef TOUCH_SCAN_SAMPLES
+#define TOUCH_SCAN_SAMPLES 64 // Conversions per channel per scan
+#endif
+
+#define TOUCH_SCAN_SCALE       30 // Results are scaled to this number of conversions
+#define TOUCH_SCAN_SAMPLE_TIME 2  // ADC sample time setting, same as ReadTouchPin()
+
+typedef struct {
+    GPIO_TypeDef* port;
+    uint8_t pin;
+    uint8_t adc_channel;
+} touch_scan_channel_t;
+
+typedef void (*touch_scan_callback_t)(void);
+
+struct _touch_scan_state {
+    const touch_scan_channel_t* channels;
+    uint8_t count;
+    uint8_t channel;                           // Channel currently being converted
+    uint8_t phase;                             // Start delay variant, 0-2
+    uint16_t round;
+    uint32_t sums[TOUCH_SCAN_MAX_CHANNELS];
+    uint32_t results[TOUCH_SCAN_MAX_CHANNELS];
+    volatile bool busy;
+    volatile bool ready;                       // New results since the last GetTouchScan()
+    uint32_t isr_time;                         // Time spent in the interrupt handler during this scan (SysTick ticks)
+    uint32_t scan_isr_time;                    // The same for the last completed scan
+    uint32_t isr_max_time;                     // Longest single run of the interrupt handler (SysTick ticks)
+    touch_scan_callback_t done_callback;
+} touch_scan_state;
+
+static void TouchScanCharge(const touch_scan_channel_t* channel) {
+    uint32_t shift = channel->pin * 4;
+    __disable_irq();
+    channel->port->CFGLR = (channel->port->CFGLR & ~(0xF << shift)) | (GPIO_CFGLR_OUT_2Mhz_PP << shift);
+    __enable_irq();
+    channel->port->BSHR = 1 << channel->pin;
+}
+
+// Start converting the current channel and release its pad
+static void TouchScanConvert() {
+    const touch_scan_channel_t* channel = &touch_scan_state.channels[touch_scan_state.channel];
+    uint32_t shift = channel->pin * 4;
+
+    ADC1->RSQR3 = channel->adc_channel;
+    ADC1->SAMPTR2 = TOUCH_SCAN_SAMPLE_TIME << (3 * channel->adc_channel);
+
+    // Only the window between the start of the conversion and the release of the pad is timing critical
+    __disable_irq();
+    uint32_t cfg = (channel->port->CFGLR & ~(0xF << shift)) | (GPIO_CFGLR_IN_PUPD << shift);
+    ADC1->CTLR2 |= ADC_SWSTART;
+    if (touch_scan_state.phase == 1) {
+        __asm__ volatile("nop\nnop");
+    } else if (touch_scan_state.phase == 2) {
+        __asm__ volatile("nop\nnop\nnop\nnop");
+    }
+    channel->port->CFGLR = cfg;
+    channel->port->BCR = 1 << channel->pin; // Pull-down
+    __enable_irq();
+}
+
+void SetupTouchScan(const touch_scan_channel_t* channels, uint8_t count, touch_scan_callback_t done_callback) {
+    touch_scan_state.channels = channels;
+    touch_scan_state.count = count;
+    touch_scan_state.busy = false;
+    touch_scan_state.ready = false;
+    touch_scan_state.scan_isr_time = 0;
+    touch_scan_state.isr_max_time = 0;
+    touch_scan_state.done_callback = done_callback;
+
+    for (uint8_t i = 0; i < count; i++) {
+        TouchScanCharge(&channels[i]);
+    }
+
+    ADC1->RSQR1 = 0; // One conversion per start
+    ADC1->CTLR1 |= ADC_EOCIE;
+    NVIC_SetPriority(ADC_IRQn, 3 << 4); // Below the I2C interrupts
+    NVIC_EnableIRQ(ADC_IRQn);
+}
+
+bool TouchScanBusy() {
+    return touch_scan_state.busy;
+}
+
+// Start a scan in the background, does nothing if a scan is already running
+void StartTouchScan() {
+    if (touch_scan_state.busy) {
+        return;
+    }
+    for (uint8_t i = 0; i < touch_scan_state.count; i++) {
+        touch_scan_state.sums[i] = 0;
+    }
+    touch_scan_state.channel = 0;
+    touch_scan_state.phase = 0;
+    touch_scan_state.round = 0;
+    touch_scan_state.isr_time = 0;
+    touch_scan_state.busy = true;
+    TouchScanConvert();
+}
+
+// Copy the results of the last completed scan, returns false if there are no new results
+bool GetTouchScan(uint32_t* values) {
+    if (!touch_scan_state.ready) {
+        return false;
+    }
+    NVIC_DisableIRQ(ADC_IRQn);
+    for (uint8_t i = 0; i < touch_scan_state.count; i++) {
+        values[i] = touch_scan_state.results[i];
+    }
+    touch_scan_state.ready = false;
+    NVIC_EnableIRQ(ADC_IRQn);
+    return true;
+}
+
+// Time the last completed scan spent in the interrupt handler, in SysTick ticks.
+// The done callback is not included.
+uint32_t GetTouchScanIsrTime() {
+    return touch_scan_state.scan_isr_time;
+}
+
+// Longest single run of the interrupt handler since the last reset, in SysTick ticks
+uint32_t GetTouchScanIsrMaxTime() {
+    return touch_scan_state.isr_max_time;
+}
+
+void ResetTouchScanIsrMaxTime() {
+    touch_scan_state.isr_max_time = 0;
+}
+
+// Run a complete scan and wait for it
+void ReadTouchScan(uint32_t* values) {
+    while (touch_scan_state.busy);
+    StartTouchScan();
+    while (!GetTouchScan(values));
+}
+
+static void TouchScanIsrDone(uint32_t isr_start) {
+    uint32_t duration = SysTick->CNT - isr_start;
+    touch_scan_state.isr_time += duration;
+    if (duration > touch_scan_state.isr_max_time) {
+        touch_scan_state.isr_max_time = duration;
+    }
+}
+
+void ADC1_IRQHandler(void) __attribute__((interrupt));
+void ADC1_IRQHandler(void) {
+    uint32_t isr_start = SysTick->CNT;
+    uint8_t index = touch_scan_state.channel;
+    touch_scan_state.sums[index] += ADC1->RDATAR; // Also clears the end of conversion flag
+    TouchScanCharge(&touch_scan_state.channels[index]);
+
+    if (++touch_scan_state.channel >= touch_scan_state.count) {
+        touch_scan_state.channel = 0;
+        if (++touch_scan_state.phase > 2) {
+            touch_scan_state.phase = 0;
+        }
+        if (++touch_scan_state.round >= TOUCH_SCAN_SAMPLES) {
+            for (uint8_t i = 0; i < touch_scan_state.count; i++) {
+                touch_scan_state.results[i] = touch_scan_state.sums[i] * TOUCH_SCAN_SCALE / TOUCH_SCAN_SAMPLES;
+            }
+            TouchScanIsrDone(isr_start);
+            touch_scan_state.scan_isr_time = touch_scan_state.isr_time;
+            touch_scan_state.ready = true;
+            touch_scan_state.busy = false;
+            if (touch_scan_state.done_callback != NULL) {
+                touch_scan_state.done_callback();
+            }
+            return;
+        }
+    }
+
+    TouchScanConvert();
+    TouchScanIsrDone(isr_start);
+}
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ * Single-File-Header for touch signal quality statistics
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 Renze Nicolai
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Statistics are computed on the touch deltas (reading minus baseline).
+//
+// Noise is measured on samples of pads that are not pressed. The mean and the
+// variance follow an exponential moving average over about TOUCH_STATS_WINDOW
+// samples, so no sample history has to be stored. The minimum and maximum are
+// taken over consecutive blocks of TOUCH_STATS_WINDOW samples and the values of
+// the last complete block are reported.
+//
+// The signal is the peak delta of the last press. The signal to noise ratio is
+// that peak divided by the standard deviation of the noise, in units of 0.1.
+
+#ifndef __TOUCH_STATS_H
+#define __TOUCH_STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef TOUCH_STATS_CHANNELS
+#define TOUCH_STATS_CHANNELS 5
+#endif
+
+#define TOUCH_STATS_WINDOW_BITS 6
+#define TOUCH_STATS_WINDOW      (1 << TOUCH_STATS_WINDOW_BITS) // Samples
+#define TOUCH_STATS_FRACTION    4 // Fractional bits of the mean
+
+typedef struct {
+    int32_t mean;       // Fixed point with TOUCH_STATS_FRACTION fractional bits
+    uint32_t variance;  // Fixed point with 2 * TOUCH_STATS_FRACTION fractional bits
+    int16_t min;        // Of the last complete block
+    int16_t max;
+    int16_t block_min;  // Of the current block
+    int16_t block_max;
+    uint16_t signal;    // Peak delta of the last press
+    uint16_t peak;      // Peak delta of the current press
+    uint8_t count;      // Samples in the current block
+    bool pressed;
+} touch_stats_channel_t;
+
+struct _touch_stats_state {
+    touch_stats_channel_t channels[TOUCH_STATS_CHANNELS];
+} touch_stats_state;
+
+static int16_t TouchStatsClamp(int32_t value) {
+    return value > INT16_MAX ? INT16_MAX : (value < INT16_MIN ? INT16_MIN : value);
+}
+
+static uint16_t TouchStatsSqrt(uint32_t value) {
+    uint32_t result = 0;
+    uint32_t bit = 1UL << 30;
+    while (bit > value) {
+        bit >>= 2;
+    }
+    while (bit != 0) {
+        if (value >= result + bit) {
+            value -= result + bit;
+            result = (result >> 1) + bit;
+        } else {
+            result >>= 1;
+        }
+        bit >>= 2;
+    }
+    return result;
+}
+
+void SetupTouchStats() {
+    for (uint8_t i = 0; i < TOUCH_STATS_CHANNELS; i++) {
+        touch_stats_channel_t* channel = &touch_stats_state.channels[i];
+        channel->mean = 0;
+        channel->variance = 0;
+        channel->min = 0;
+        channel->max = 0;
+        channel->block_min = INT16_MAX;
+        channel->block_max = INT16_MIN;
+        channel->signal = 0;
+        channel->peak = 0;
+        channel->count = 0;
+        channel->pressed = false;
+    }
+}
+
+// Process one scan, pressed is the bitmask of pressed pads
+void UpdateTouchStats(const int32_t* delta, uint8_t pressed) {
+    for (uint8_t i = 0; i < TOUCH_STATS_CHANNELS; i++) {
+        touch_stats_channel_t* channel = &touch_stats_state.channels[i];
+        int16_t value = TouchStatsClamp(delta[i]);
+
+        if ((pressed >> i) & 1) {
+            if (value > 0 && (uint16_t) value > channel->peak) {
+                channel->peak = value;
+            }
+            channel->pressed = true;
+            continue;
+        }
+        if (channel->pressed) {
+            channel->signal = channel->peak;
+            channel->peak = 0;
+            channel->pressed = false;
+        }
+
+        int32_t error = ((int32_t) value << TOUCH_STATS_FRACTION) - channel->mean;
+        channel->mean += error >> TOUCH_STATS_WINDOW_BITS;
+        uint32_t magnitude = error < 0 ? -error : error;
+        if (magnitude > 0xFFFF) {
+            magnitude = 0xFFFF;
+        }
+        uint32_t square = magnitude * magnitude;
+        if (square > channel->variance) {
+            channel->variance += (square - channel->variance) >> TOUCH_STATS_WINDOW_BITS;
+        } else {
+            channel->variance -= (channel->variance - square) >> TOUCH_STATS_WINDOW_BITS;
+        }
+
+        if (value < channel->block_min) channel->block_min = value;
+        if (value > channel->block_max) channel->block_max = value;
+        if (++channel->count >= TOUCH_STATS_WINDOW) {
+            channel->min = channel->block_min;
+            channel->max = channel->block_max;
+            channel->block_min = INT16_MAX;
+            channel->block_max = INT16_MIN;
+            channel->count = 0;
+        }
+    }
+}
+
+int16_t GetTouchStatsMin(uint8_t channel) {
+    return touch_stats_state.channels[channel].min;
+}
+
+int16_t GetTouchStatsMax(uint8_t channel) {
+    return touch_stats_state.channels[channel].max;
+}
+
+uint32_t GetTouchStatsVariance(uint8_t channel) {
+    return touch_stats_state.channels[channel].variance >> (2 * TOUCH_STATS_FRACTION);
+}
+
+// Signal to noise ratio in units of 0.1, 0 before the first press
+uint16_t GetTouchStatsSnr(uint8_t channel) {
+    touch_stats_channel_t* stats = &touch_stats_state.channels[channel];
+    uint16_t noise = TouchStatsSqrt(stats->variance); // With TOUCH_STATS_FRACTION fractional bits
+    uint32_t snr = ((uint32_t) stats->signal * 10 << TOUCH_STATS_FRACTION) / (noise > 0 ? noise : 1);
+    return snr > 0xFFFF ? 0xFFFF : snr;
+}
+
+#endif